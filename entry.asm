@@ -5,7 +5,12 @@ extern main
 
 MODULEALIGN equ 1<<0
 MEMINFO equ 1<<1
+VIDEOMODE equ 1<<2
+%ifdef VBE
+FLAGS equ MODULEALIGN | MEMINFO | VIDEOMODE
+%else
 FLAGS equ MODULEALIGN | MEMINFO
+%endif
 MAGIC equ 0x1BADB002
 CHECKSUM equ -(MAGIC + FLAGS)
 
@@ -15,11 +20,139 @@ MultiBootHeader:
   dd MAGIC
   dd FLAGS
   dd CHECKSUM
+%ifdef VBE
+  ; Address fields, unused as this is an ELF image
+  dd 0, 0, 0, 0, 0
+  ; Preferred graphics mode: linear framebuffer, 640x480x32
+  dd 0
+  dd 640
+  dd 480
+  dd 32
+%endif
 
 section .text
 
 STACKSIZE equ 0x4000
 
+%ifdef LONG
+
+; x86-64 build: the loader starts in 32-bit protected mode as usual, identity
+; maps the first 4 GiB (which covers the kernel, VGA memory and any linear
+; framebuffer) with 2 MiB pages, enters long mode and calls main() as 64-bit
+; code, with the Multiboot info and magic as its arguments.
+
+EFER equ 0xC0000080
+
+bits 32
+loader:
+  mov esp, stack+STACKSIZE
+  mov edi, ebx
+  mov esi, eax
+
+  ; Give up unless the CPU supports long mode
+  mov eax, 0x80000000
+  cpuid
+  cmp eax, 0x80000001
+  jb hang
+  mov eax, 0x80000001
+  cpuid
+  test edx, 1 << 29
+  jz hang
+
+  ; PML4 -> one PDPT -> four page directories of 512 2 MiB pages each
+  mov dword [pml4], pdpt + 3
+  mov eax, pd + 3
+  xor ecx, ecx
+.pdpt:
+  mov [pdpt + ecx * 8], eax
+  add eax, 0x1000
+  inc ecx
+  cmp ecx, 4
+  jb .pdpt
+
+  mov eax, 0x83         ; Present, writable, 2 MiB page
+  xor edx, edx
+  xor ecx, ecx
+.pd:
+  mov [pd + ecx * 8], eax
+  mov [pd + ecx * 8 + 4], edx
+  add eax, 0x200000
+  adc edx, 0
+  inc ecx
+  cmp ecx, 4 * 512
+  jb .pd
+
+  mov eax, pml4
+  mov cr3, eax
+
+  ; PAE, and SSE (OSFXSR, OSXMMEXCPT), which 64-bit code uses for floating
+  ; point
+  mov eax, cr4
+  or eax, (1 << 5) | (1 << 9) | (1 << 10)
+  mov cr4, eax
+
+  mov ecx, EFER
+  rdmsr
+  or eax, 1 << 8        ; Long mode enable
+  wrmsr
+
+  ; Paging on, no x87 emulation, monitor coprocessor
+  mov eax, cr0
+  and eax, ~(1 << 2)
+  or eax, (1 << 31) | (1 << 1)
+  mov cr0, eax
+
+  lgdt [gdt.ptr]
+  jmp gdt.code:long_mode
+
+bits 64
+long_mode:
+  mov ax, gdt.data
+  mov ds, ax
+  mov es, ax
+  mov fs, ax
+  mov gs, ax
+  mov ss, ax
+  mov rsp, stack+STACKSIZE
+
+  ; main(mbi, magic), zero extended
+  mov edi, edi
+  mov esi, esi
+  call main
+
+  cli
+
+hang:
+  hlt
+  jmp hang
+
+section .rodata
+align 8
+gdt:
+  dq 0
+.code: equ $ - gdt
+  dq (1 << 43) | (1 << 44) | (1 << 47) | (1 << 53) ; Code, present, 64-bit
+.data: equ $ - gdt
+  dq (1 << 41) | (1 << 44) | (1 << 47)             ; Data, writable, present
+.ptr:
+  dw $ - gdt - 1
+  dq gdt
+
+section .bss
+align 4096
+pml4:
+  resb 0x1000
+pdpt:
+  resb 0x1000
+pd:
+  resb 4 * 0x1000
+align 16
+stack:
+  resb STACKSIZE
+stack_ptr:
+
+%else
+
 loader:
   mov esp, stack+STACKSIZE
   push eax
@@ -38,3 +171,5 @@ align 4
 stack:
   resb STACKSIZE
 stack_ptr:
+
+%endif
@@ -8,6 +8,7 @@ typedef unsigned int       u32;
 typedef signed   int       s32;
 typedef unsigned long long u64;
 typedef signed   long long s64;
+typedef unsigned long      uptr; /* Pointer sized, in both the i386 and x86-64 builds */
 
 #define noreturn __attribute__((noreturn)) void
 
@@ -27,26 +28,65 @@ static inline double pow(double a, double b)
     return result;
 }
 
+/* Memory */
+
+/* GCC may emit calls to these for struct copies even when freestanding, so
+ * they have to exist with their usual names and signatures. */
+void *memcpy(void *dst, const void *src, uptr n)
+{
+    u8 *d = dst;
+    const u8 *s = src;
+    while (n--)
+        *d++ = *s++;
+    return dst;
+}
+
+void *memset(void *dst, int c, uptr n)
+{
+    u8 *d = dst;
+    while (n--)
+        *d++ = (u8) c;
+    return dst;
+}
+
 /* Port I/O */
 
 static inline u8 inb(u16 p)
 {
     u8 r;
-    asm("inb %1, %0" : "=a" (r) : "dN" (p));
+    asm volatile("inb %1, %0" : "=a" (r) : "dN" (p));
     return r;
 }
 
 static inline void outb(u16 p, u8 d)
 {
-    asm("outb %1, %0" : : "dN" (p), "a" (d));
+    asm volatile("outb %1, %0" : : "dN" (p), "a" (d));
+}
+
+static inline u16 inw(u16 p)
+{
+    u16 r;
+    asm volatile("inw %1, %0" : "=a" (r) : "dN" (p));
+    return r;
+}
+
+static inline void outw(u16 p, u16 d)
+{
+    asm volatile("outw %1, %0" : : "dN" (p), "a" (d));
 }
 
-/* Divide by zero (in a loop to satisfy the noreturn attribute) in order to
- * trigger a division by zero ISR, which is unhandled and causes a hard reset.
+/* Load an empty IDT and divide by zero (in a loop to satisfy the noreturn
+ * attribute), so that the division by zero ISR is missing and the CPU triple
+ * faults, which causes a hard reset.
  */
 noreturn reset(void)
 {
+    struct __attribute__((packed)) {
+        u16 limit;
+        uptr base;
+    } none = {0, 0};
     volatile u8 one = 1, zero = 0;
+    asm volatile("lidt %0" : : "m" (none));
     while (true)
         one /= zero;
 }
@@ -54,7 +94,7 @@ noreturn reset(void)
 /* Timing */
 
 /* Return the number of CPU ticks since boot. */
-static inline u64 rdtsc(void)
+static inline __attribute__((always_inline)) u64 rdtsc(void)
 {
     u32 hi, lo;
     asm("rdtsc" : "=a" (lo), "=d" (hi));
@@ -80,6 +120,9 @@ u8 rtcs(void)
 /* The number of CPU ticks per millisecond */
 u64 tpms;
 
+/* The RTC second tps() last saw, for readers that shouldn't touch CMOS */
+u8 rtc_sec = 0xFF;
+
 /* Set tpms to the number of CPU ticks per millisecond based on the number of
  * ticks in the last second, if the RTC second has changed since the last call.
  * This gets called on every iteration of the main loop in order to provide
@@ -87,10 +130,9 @@ u64 tpms;
 void tps(void)
 {
     static u64 ti = 0;
-    static u8 last_sec = 0xFF;
     u8 sec = rtcs();
-    if (sec != last_sec) {
-        last_sec = sec;
+    if (sec != rtc_sec) {
+        rtc_sec = sec;
         u64 tf = rdtsc();
         tpms = (u32) ((tf - ti) >> 3) / 125; /* Less chance of truncation */
         ti = tf;
@@ -101,6 +143,10 @@ void tps(void)
 enum timer {
     TIMER_UPDATE,
     TIMER_CLEAR,
+    TIMER_REWIND,
+    TIMER_PARTICLES,
+    TIMER_CONSOLE,
+    TIMER_WATCHDOG,
     TIMER__LENGTH
 };
 
@@ -133,739 +179,4434 @@ bool wait(enum timer timer, u32 ms)
     }
 }
 
-/* Video Output */
+/* Trace
+ *
+ * The last TRACE_EVENTS notable events (keys, level changes, overruns, ...),
+ * in a ring for the report on a CPU exception to show what led up to it. */
 
-/* Seven possible display colors. Bright variations can be used by bitwise OR
- * with BRIGHT (i.e. BRIGHT | BLUE). */
-enum color {
-    BLACK,
-    BLUE,
-    GREEN,
-    CYAN,
-    RED,
-    MAGENTA,
-    YELLOW,
-    GRAY,
-    BRIGHT
+enum trace_kind {
+    TRACE_KEY,
+    TRACE_LEVEL,
+    TRACE_SET,
+    TRACE_DISK,
+    TRACE_OVERRUN,
+    TRACE_GAME_OVER,
+    TRACE__LENGTH
 };
 
-#define COLS (80)
-#define ROWS (25)
-u16 *const video = (u16*) 0xB8000;
+const char *const trace_names[TRACE__LENGTH] = {
+    "key", "level", "set", "disk write", "overrun", "game over"
+};
 
-/* Display a character at x, y in fg foreground color and bg background color.
- */
-void putc(u8 x, u8 y, enum color fg, enum color bg, char c)
+struct trace_event {
+    u64 t;
+    u32 loop, value;
+    u8 kind, arg;
+};
+
+struct trace_event trace_ring[TRACE_EVENTS];
+u32 trace_count = 0;
+
+/* Main loop iterations, by which events are dated as well as by CPU tick */
+u32 loops = 0;
+
+/* Record an event of kind, with a detail arg and a value. */
+void trace(enum trace_kind kind, u8 arg, u32 value)
 {
-    u16 z = (bg << 12) | (fg << 8) | c;
-    video[y * COLS + x] = z;
+    struct trace_event *e = &trace_ring[trace_count % TRACE_EVENTS];
+    e->t = rdtsc();
+    e->loop = loops;
+    e->value = value;
+    e->kind = kind;
+    e->arg = arg;
+    trace_count++;
 }
 
-/* Display a string starting at x, y in fg foreground color and bg background
- * color. Characters in the string are not interpreted (e.g \n, \b, \t, etc.).
- * */
-void puts(u8 x, u8 y, enum color fg, enum color bg, const char *s)
+/* Interrupts
+ *
+ * The kernel loads a flat GDT of its own (the x86-64 loader has already) and
+ * an IDT with room for the CPU exceptions, the sixteen PIC lines, which are
+ * remapped to IRQ_BASE and up and all masked but those given a handler, and
+ * VECTOR_YIELD, the software interrupt by which a task gives up its turn.
+ * A handler is a function declared isr, which GCC enters and leaves with the
+ * registers saved and an iret, calling plain C to do the work. Only the
+ * general registers are saved, so that C must keep off floating point. */
+
+#define isr __attribute__((interrupt, target("general-regs-only"))) void
+
+struct interrupt_frame;
+
+#define IRQ_BASE     (0x20)
+#define VECTOR_YIELD (IRQ_BASE + 16)
+#define IDT_ENTRIES  (IRQ_BASE + 17)
+
+#define PIC1    (0x20)
+#define PIC2    (0xA0)
+#define PIC_EOI (0x20)
+
+#ifdef __x86_64__
+struct IdtEntry {
+    u16 offset_lo, selector;
+    u8 ist, type;
+    u16 offset_mid;
+    u32 offset_hi, zero;
+};
+#else
+struct IdtEntry {
+    u16 offset_lo, selector;
+    u8 zero, type;
+    u16 offset_hi;
+};
+#endif
+
+/* Present, ring 0, interrupt gate (interrupts stay off in the handler) */
+#define IDT_GATE (0x8E)
+
+struct IdtEntry idt[IDT_ENTRIES];
+
+/* Operand of lgdt and lidt */
+struct __attribute__((packed)) DescriptorPointer {
+    u16 limit;
+    uptr base;
+};
+
+#ifndef __x86_64__
+/* Null, then flat ring 0 code and data segments */
+const u64 gdt[3] = {0, 0x00CF9A000000FFFFull, 0x00CF92000000FFFFull};
+#endif
+
+/* Point the IDT entry for vector v at handler. */
+void idt_set(u8 v, uptr handler)
 {
-    for (; *s; s++, x++)
-        putc(x, y, fg, bg, *s);
+    u16 cs;
+    asm volatile("mov %%cs, %0" : "=r" (cs));
+    idt[v].offset_lo = (u16) handler;
+    idt[v].selector = cs;
+    idt[v].type = IDT_GATE;
+#ifdef __x86_64__
+    idt[v].offset_mid = (u16) (handler >> 16);
+    idt[v].offset_hi = (u32) (handler >> 32);
+#else
+    idt[v].offset_hi = (u16) (handler >> 16);
+#endif
 }
 
-/* Clear the screen to bg backround color. */
-void clear(enum color bg)
+/* Unmask PIC line irq. */
+void irq_unmask(u8 irq)
 {
-    u8 x, y;
-    for (y = 0; y < ROWS; y++)
-        for (x = 0; x < COLS; x++)
-            putc(x, y, bg, bg, ' ');
+    u16 port = irq < 8 ? PIC1 + 1 : PIC2 + 1;
+    outb(port, inb(port) & ~(1 << (irq & 7)));
+    if (irq >= 8)
+        irq_unmask(2); /* The cascade */
 }
 
-/* Keyboard Input */
+/* A PIC line that is masked only ever fires spuriously, and a spurious IRQ
+ * from the master gets no EOI. */
+isr irq_spurious(struct interrupt_frame *frame)
+{
+    (void) frame;
+}
 
-#define KEY_1     (0x2)
-#define KEY_2     (0x3)
-#define KEY_3     (0x4)
-#define KEY_4     (0x5)
-#define KEY_D     (0x20)
-#define KEY_H     (0x23)
-#define KEY_P     (0x19)
-#define KEY_R     (0x13)
-#define KEY_S     (0x1F)
-#define KEY_UP    (0x48)
-#define KEY_DOWN  (0x50)
-#define KEY_LEFT  (0x4B)
-#define KEY_RIGHT (0x4D)
-#define KEY_ENTER (0x1C)
-#define KEY_SPACE (0x39)
+/* Tell the master PIC that the IRQ being handled is over. */
+void irq_eoi(void)
+{
+    outb(PIC1, PIC_EOI);
+}
 
-/* Return the scancode of the current up or down key if it has changed since
- * the last call, otherwise returns 0. When called on every iteration of the
- * main loop, returns non-zero on a key event. */
-u8 scan(void)
+/* Only the master must be told that a spurious IRQ from the slave is over. */
+isr irq_spurious_slave(struct interrupt_frame *frame)
 {
-    static u8 key = 0;
-    u8 scan = inb(0x60);
-    if (scan != key)
-        return key = scan;
-    else return 0;
+    (void) frame;
+    irq_eoi();
 }
 
-/* PC Speaker */
+/* Load the GDT and an empty IDT, and remap and mask the PICs. Interrupts stay
+ * off until irq_start(). */
+void irq_init(void)
+{
+    struct DescriptorPointer p;
 
-/* Set the frequency of the PC speaker through timer 2 of the programmable
- * interrupt timer (PIT). */
-void pcspk_freq(u32 hz)
+#ifndef __x86_64__
+    p.limit = sizeof(gdt) - 1;
+    p.base = (uptr) gdt;
+    asm volatile("lgdt %0\n\t"
+                 "ljmp $0x08, $1f\n"
+                 "1:\n\t"
+                 "mov %w1, %%ds\n\t"
+                 "mov %w1, %%es\n\t"
+                 "mov %w1, %%fs\n\t"
+                 "mov %w1, %%gs\n\t"
+                 "mov %w1, %%ss"
+                 : : "m" (p), "r" (0x10) : "memory");
+#endif
+    p.limit = sizeof(idt) - 1;
+    p.base = (uptr) idt;
+    asm volatile("lidt %0" : : "m" (p));
+
+    outb(PIC1, 0x11); /* Initialise, with ICW4 */
+    outb(PIC2, 0x11);
+    outb(PIC1 + 1, IRQ_BASE);
+    outb(PIC2 + 1, IRQ_BASE + 8);
+    outb(PIC1 + 1, 1 << 2); /* Slave on line 2 */
+    outb(PIC2 + 1, 2);
+    outb(PIC1 + 1, 0x01); /* 8086 mode */
+    outb(PIC2 + 1, 0x01);
+    outb(PIC1 + 1, 0xFF);
+    outb(PIC2 + 1, 0xFF);
+    idt_set(IRQ_BASE + 7, (uptr) irq_spurious);
+    idt_set(IRQ_BASE + 15, (uptr) irq_spurious_slave);
+}
+
+/* Turn interrupts on. */
+void irq_start(void)
 {
-    u32 div = 1193180 / hz;
-    outb(0x43, 0xB6);
-    outb(0x42, (u8) div);
-    outb(0x42, (u8) (div >> 8));
+    asm volatile("sti" : : : "memory");
 }
 
-/* Enable timer 2 of the PIT to drive the PC speaker. */
-void pcspk_on(void)
+/* Turn interrupts off, returning whether they were on for irq_restore(). */
+static inline uptr irq_save(void)
 {
-    outb(0x61, inb(0x61) | 0x3);
+    uptr flags;
+    asm volatile("pushf\n\tpop %0\n\tcli" : "=r" (flags) : : "memory");
+    return flags;
 }
 
-/* Disable timer 2 of the PIT to drive the PC speaker. */
-void pcspk_off(void)
+static inline void irq_restore(uptr flags)
 {
-    outb(0x61, inb(0x61) & 0xFC);
+    asm volatile("push %0\n\tpopf" : : "r" (flags) : "memory", "cc");
 }
 
-/* Formatting */
+/* Serial ports */
 
-/* Format n in radix r (2-16) as a w length string. */
-char *itoa(u32 n, u8 r, u8 w)
+/* COM1 to COM4, at 115200 baud 8N1. Until uart_irq_start(), output is polled.
+ * After, bytes in both directions go through rings serviced by the port's
+ * IRQ: received bytes are queued for uart_getc() (and dropped if it falls
+ * behind), and output is queued and sent 16 bytes, a FIFO's worth, per IRQ.
+ * Output goes nowhere if there is no UART (the line status then reads as all
+ * ones). COM1 carries the console and the reports, through serial_*(). */
+
+#define SERIAL_IER_RX (0x01) /* Received data available */
+#define SERIAL_IER_TX (0x02) /* Transmit holding register empty */
+#define SERIAL_IIR_NONE (0x01) /* No interrupt pending */
+#define SERIAL_LSR_DR   (0x01) /* Data ready */
+#define SERIAL_LSR_THRE (0x20) /* Transmit FIFO empty */
+#define SERIAL_FIFO (16)
+
+/* Sizes of the rings, powers of two */
+#define SERIAL_RX (256)
+#define SERIAL_TX (4096)
+
+struct Uart {
+    u16 port;
+    u8 irq_line;
+    bool present;
+    bool irq; /* Whether the IRQ services the rings */
+    volatile bool sending; /* Whether it is waiting to send */
+    u8 rx[SERIAL_RX], tx[SERIAL_TX];
+    volatile u32 rx_head, rx_tail, tx_head, tx_tail;
+    volatile u32 rx_dropped;
+};
+
+#define N_UARTS (4)
+
+/* COM1 and COM3 share a PIC line, and so do COM2 and COM4. */
+struct Uart uarts[N_UARTS] = {
+    {.port = 0x3F8, .irq_line = 4},
+    {.port = 0x2F8, .irq_line = 3},
+    {.port = 0x3E8, .irq_line = 4},
+    {.port = 0x2E8, .irq_line = 3}
+};
+
+#define COM1 (&uarts[0])
+
+void uart_init(struct Uart *u)
 {
-    static const char d[16] = "0123456789ABCDEF";
-    static char s[34];
-    s[33] = 0;
-    u8 i = 33;
+    outb(u->port + 1, 0x00); /* No interrupts */
+    outb(u->port + 3, 0x80); /* Divisor latch */
+    outb(u->port + 0, 0x01); /* 115200 baud */
+    outb(u->port + 1, 0x00);
+    outb(u->port + 3, 0x03); /* 8 bits, no parity, one stop bit */
+    outb(u->port + 2, 0xC7); /* FIFOs on and cleared */
+    outb(u->port + 4, 0x03); /* DTR, RTS */
+    u->present = inb(u->port + 5) != 0xFF;
+}
+
+void uart_putc(struct Uart *u, char c)
+{
+    uptr flags;
+
+    if (!u->irq) {
+        while (!(inb(u->port + 5) & SERIAL_LSR_THRE));
+        outb(u->port, c);
+        return;
+    }
+    while (u->tx_head - u->tx_tail == SERIAL_TX); /* Full */
+    u->tx[u->tx_head % SERIAL_TX] = c;
+    u->tx_head++;
+    if (!u->sending) {
+        flags = irq_save();
+        u->sending = true;
+        outb(u->port + 1, SERIAL_IER_RX | SERIAL_IER_TX);
+        irq_restore(flags);
+    }
+}
+
+/* Write s to u, with \n sent as \r\n. */
+void uart_puts(struct Uart *u, const char *s)
+{
+    for (; *s; s++) {
+        if (*s == '\n')
+            uart_putc(u, '\r');
+        uart_putc(u, *s);
+    }
+}
+
+/* Return how many bytes can be written to u without waiting. */
+u32 uart_room(const struct Uart *u)
+{
+    return u->irq ? SERIAL_TX - (u->tx_head - u->tx_tail) : SERIAL_FIFO;
+}
+
+/* Return the next byte u received, or -1 if there is none. */
+s32 uart_getc(struct Uart *u)
+{
+    u8 c;
+    if (u->rx_tail == u->rx_head)
+        return -1;
+    c = u->rx[u->rx_tail % SERIAL_RX];
+    u->rx_tail++;
+    return c;
+}
+
+/* Take what u has received, and refill its transmit FIFO once it is empty. */
+void uart_service(struct Uart *u)
+{
+    u32 n;
+    u8 c;
+
+    while (inb(u->port + 5) & SERIAL_LSR_DR) {
+        c = inb(u->port);
+        if (u->rx_head - u->rx_tail < SERIAL_RX) {
+            u->rx[u->rx_head % SERIAL_RX] = c;
+            u->rx_head++;
+        } else u->rx_dropped++;
+    }
+    if (u->sending && inb(u->port + 5) & SERIAL_LSR_THRE) {
+        for (n = 0; n < SERIAL_FIFO && u->tx_tail != u->tx_head; n++) {
+            outb(u->port, u->tx[u->tx_tail % SERIAL_TX]);
+            u->tx_tail++;
+        }
+        if (u->tx_tail == u->tx_head) {
+            u->sending = false;
+            outb(u->port + 1, SERIAL_IER_RX);
+        }
+    }
+}
+
+/* Service the UARTs on PIC line irq until none of them has an interrupt
+ * pending: the line is edge triggered, so one that interrupts while another
+ * is served raises no new IRQ. */
+void serial_service(u8 irq)
+{
+    bool again;
+    u32 i;
+
     do {
-        i--;
-        s[i] = d[n % r];
-        n /= r;
-    } while (i > 33 - w);
-    return (char *) (s + i);
+        again = false;
+        for (i = 0; i < N_UARTS; i++) {
+            if (!uarts[i].irq || uarts[i].irq_line != irq
+                    || inb(uarts[i].port + 2) & SERIAL_IIR_NONE)
+                continue;
+            uart_service(&uarts[i]);
+            again = true;
+        }
+    } while (again);
+    irq_eoi();
 }
 
-/* Random */
+isr serial_irq3_handler(struct interrupt_frame *frame)
+{
+    (void) frame;
+    serial_service(3);
+}
 
-/* Generate a random number from 0 inclusive to range exclusive from the number
- * of CPU ticks since boot. */
-u32 rand(u32 range)
+isr serial_irq4_handler(struct interrupt_frame *frame)
 {
-    return (u32) rdtsc() % range;
+    (void) frame;
+    serial_service(4);
 }
 
-/* Shuffle an array of bytes arr of length len in-place using Fisher-Yates. */
-void shuffle(u8 arr[], u32 len)
+/* Hand u over to its IRQ. Call with interrupts off. Without a UART there,
+ * output stays polled (and goes nowhere) rather than filling a ring that no
+ * IRQ drains. */
+void uart_irq_start(struct Uart *u)
 {
-    u32 i, j;
-    u8 t;
-    for (i = len - 1; i > 0; i--) {
-        j = rand(i + 1);
-        t = arr[i];
-        arr[i] = arr[j];
-        arr[j] = t;
+    if (!u->present)
+        return;
+    idt_set(IRQ_BASE + u->irq_line, u->irq_line == 3
+            ? (uptr) serial_irq3_handler : (uptr) serial_irq4_handler);
+    outb(u->port + 4, 0x0B); /* DTR, RTS, and OUT2, which gates the IRQ */
+    outb(u->port + 1, SERIAL_IER_RX);
+    irq_unmask(u->irq_line);
+    u->irq = true;
+}
+
+/* Send what is still queued, and take u back from its IRQ, for when
+ * interrupts are off for good. */
+void uart_polled(struct Uart *u)
+{
+    outb(u->port + 1, 0x00);
+    while (u->irq && u->tx_tail != u->tx_head) {
+        while (!(inb(u->port + 5) & SERIAL_LSR_THRE));
+        outb(u->port, u->tx[u->tx_tail % SERIAL_TX]);
+        u->tx_tail++;
     }
+    u->irq = false;
 }
 
-//##################################################################################################################################################################################
-//----------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
-//LOGICA DEL JUEGO
-//----------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
-//##################################################################################################################################################################################
+void serial_init(void)
+{
+    uart_init(COM1);
+}
 
-/* Two-dimensional array of color values */
-u8 well[WELL_HEIGHT][WELL_WIDTH];
+void serial_putc(char c)
+{
+    uart_putc(COM1, c);
+}
 
-struct Piece {
-    u32 i; /* Index*/
-    u32 hp; /*HP*/
-    u32 dmg; /*Damage*/
-    bool alive; /*State*/
-    s8 x, y; /* Coordinates */
+void serial_puts(const char *s)
+{
+    uart_puts(COM1, s);
+}
+
+s32 serial_getc(void)
+{
+    return uart_getc(COM1);
+}
+
+void serial_irq_start(void)
+{
+    uart_irq_start(COM1);
+}
+
+void serial_polled(void)
+{
+    uart_polled(COM1);
+}
+
+/* Disk
+ *
+ * The primary ATA master, driven by PIO with interrupts off. Writes are queued
+ * and disk_poll(), called once a frame, moves the one at the head of the queue
+ * along by at most one step without ever waiting on the drive: issue the
+ * command, send the sector once the drive asks for it, and check the result.
+ * After the last queued write the drive's cache is flushed. */
+
+#define ATA_DATA    (0x1F0)
+#define ATA_COUNT   (0x1F2)
+#define ATA_LBA0    (0x1F3)
+#define ATA_LBA1    (0x1F4)
+#define ATA_LBA2    (0x1F5)
+#define ATA_DRIVE   (0x1F6)
+#define ATA_STATUS  (0x1F7) /* Status when read, command when written */
+#define ATA_CONTROL (0x3F6)
+
+#define ATA_ERR (0x01)
+#define ATA_DRQ (0x08)
+#define ATA_DF  (0x20)
+#define ATA_BSY (0x80)
+
+#define ATA_NIEN (0x02) /* No interrupts, in ATA_CONTROL */
+
+#define ATA_READ     (0x20)
+#define ATA_WRITE    (0x30)
+#define ATA_FLUSH    (0xE7)
+#define ATA_IDENTIFY (0xEC)
+
+#define SECTOR (512)
+
+/* Status polls before giving up on the drive at boot */
+#define DISK_TIMEOUT (1000000)
+
+enum disk_state {
+    DISK_IDLE,
+    DISK_SEND, /* Write issued, waiting to send the sector */
+    DISK_SENT, /* Sector sent, waiting for the result */
+    DISK_FLUSH
 };
 
-#define N_ENEMYS (25)
-#define N_LASERS (25)
-#define N_WALLS (80)
+/* Sectors on the drive, 0 if there is none */
+u32 disk_sectors = 0;
 
-    struct Piece enemy[N_ENEMYS];
-    struct Piece laser[N_LASERS];
-    struct Piece wall[N_WALLS];
-    struct Piece player;
+enum disk_state disk_state = DISK_IDLE;
 
-u32 score = 0, level = 1, speed = INITIAL_SPEED;
+/* Queued writes: sectors disk_head up to disk_tail of the ring, and the
+ * number that failed */
+u8 disk_data[DISK_QUEUE][SECTOR];
+u32 disk_lba[DISK_QUEUE];
+u32 disk_head = 0, disk_tail = 0, disk_errors = 0;
 
-bool paused = false, game_over = false;
+/* Wait the 400ns the drive may take to update its status, by reading the
+ * alternate status register a few times. */
+void ata_delay(void)
+{
+    inb(ATA_CONTROL);
+    inb(ATA_CONTROL);
+    inb(ATA_CONTROL);
+    inb(ATA_CONTROL);
+}
+
+/* Issue command for one sector at lba. */
+void ata_command(u8 command, u32 lba)
+{
+    outb(ATA_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));
+    outb(ATA_COUNT, 1);
+    outb(ATA_LBA0, lba);
+    outb(ATA_LBA1, lba >> 8);
+    outb(ATA_LBA2, lba >> 16);
+    outb(ATA_STATUS, command);
+    ata_delay();
+}
+
+/* Wait until the drive is no longer busy and has data to transfer, and return
+ * true unless it reported an error or took too long. Only used at boot. */
+bool ata_wait(void)
+{
+    u32 i;
+    u8 s;
+    for (i = 0; i < DISK_TIMEOUT; i++) {
+        s = inb(ATA_STATUS);
+        if (s & ATA_BSY)
+            continue;
+        if (s & (ATA_ERR | ATA_DF))
+            return false;
+        if (s & ATA_DRQ)
+            return true;
+    }
+    return false;
+}
 
-#define WALLSPAWN (75000)
-#define WALLMOVE (37500)
-#define ENEMYSPAWN (200000)
-#define ENEMYMOVE (100000)
-#define STARTWALLCHANGE (1000000)
+/* Look for the drive and set disk_sectors. */
+void disk_init(void)
+{
+    u16 id[SECTOR / 2];
+    u32 i;
 
-#define DIRECTIONSIZE (24)
-#define REPEATMOVE (9)
+    outb(ATA_CONTROL, ATA_NIEN);
+    outb(ATA_DRIVE, 0xA0);
+    ata_delay();
+    if (inb(ATA_STATUS) == 0xFF) /* Nothing on the bus */
+        return;
+    outb(ATA_COUNT, 0);
+    outb(ATA_LBA0, 0);
+    outb(ATA_LBA1, 0);
+    outb(ATA_LBA2, 0);
+    outb(ATA_STATUS, ATA_IDENTIFY);
+    ata_delay();
+    if (!inb(ATA_STATUS))
+        return;
+    for (i = 0; i < DISK_TIMEOUT && inb(ATA_STATUS) & ATA_BSY; i++)
+        ;
+    if (inb(ATA_LBA1) || inb(ATA_LBA2)) /* Not ATA (a CD drive, say) */
+        return;
+    if (!ata_wait())
+        return;
+    for (i = 0; i < SECTOR / 2; i++)
+        id[i] = inw(ATA_DATA);
+    disk_sectors = id[60] | (u32) id[61] << 16;
+}
 
-u32 wallspawn = WALLSPAWN, wallmove = WALLMOVE, enemyspawn = ENEMYSPAWN, enemymove = ENEMYMOVE, startwallchange = STARTWALLCHANGE;
+/* Read sector lba into data, waiting for the drive, and return true if
+ * successful. Only used at boot, before the game loop starts. */
+bool disk_read(u32 lba, void *data)
+{
+    u16 *w = data;
+    u32 i;
 
-u32 cont_enemyspawn = 0, cont_wallspawn = 0, cont_enemymove = 0, cont_wallmove = 0;
+    if (lba >= disk_sectors)
+        return false;
+    ata_command(ATA_READ, lba);
+    if (!ata_wait())
+        return false;
+    for (i = 0; i < SECTOR / 2; i++)
+        w[i] = inw(ATA_DATA);
+    return true;
+}
 
-u8 direction[DIRECTIONSIZE] = { 0, 1, 1, 0, 0, 1, 1, 0, 0, 2, 1, 2, 1, 0, 0, 1, 1, 0, 1, 2, 0, 0, 2, 1 };
-u8 dx = 0;
-u32 cont_start_dx = 0, cont_repeat = REPEATMOVE, cont_change = 0;
+/* Return true if writes are still queued or in progress. */
+bool disk_busy(void)
+{
+    return disk_head != disk_tail || disk_state != DISK_IDLE;
+}
 
-// Initialize next level 
-void next_level(u32 l) {
-    
-    level = l;
+/* Queue sector lba to be written from data, copied now. Return false if there
+ * is no drive, or no room in the queue. */
+bool disk_write(u32 lba, const void *data)
+{
+    if (lba >= disk_sectors || disk_tail - disk_head == DISK_QUEUE)
+        return false;
+    if (!disk_busy())
+        trace(TRACE_DISK, 0, lba);
+    disk_lba[disk_tail % DISK_QUEUE] = lba;
+    memcpy(disk_data[disk_tail % DISK_QUEUE], data, SECTOR);
+    disk_tail++;
+    return true;
+}
 
-    // Initialize level settings 
-        switch(l) {
-        case 1:
-            enemyspawn = ENEMYSPAWN; 
-            wallspawn = WALLSPAWN; 
-            enemymove = ENEMYMOVE;  
-            wallmove = WALLMOVE;   
-            break;
-        case 2:
-            enemyspawn = ENEMYSPAWN * 2; 
-            wallspawn = WALLSPAWN; 
-            enemymove = ENEMYMOVE;  
-            wallmove = WALLMOVE; 
-            startwallchange = STARTWALLCHANGE * 1.5;  
-            break;
-        case 3:
-            enemyspawn = ENEMYSPAWN * 1.5; 
-            wallspawn = WALLSPAWN; 
-            enemymove = ENEMYMOVE;  
-            wallmove = WALLMOVE; 
-            startwallchange = STARTWALLCHANGE * 1.5;              
-            break;
-        case 4:
-            enemyspawn = ENEMYSPAWN * 1.5; 
-            wallspawn = enemyspawn / 2; 
-            enemymove = ENEMYMOVE * 2;  
-            wallmove = enemymove; 
-            startwallchange = STARTWALLCHANGE * 10;  
-            break;
+/* Move the queued writes along by one step, if the drive is ready for it. */
+void disk_poll(void)
+{
+    const u16 *w;
+    u32 i;
+    u8 s;
+
+    if (!disk_busy())
+        return;
+    s = inb(ATA_STATUS);
+    if (s & ATA_BSY)
+        return;
+
+    switch (disk_state) {
+    case DISK_IDLE:
+        ata_command(ATA_WRITE, disk_lba[disk_head % DISK_QUEUE]);
+        disk_state = DISK_SEND;
+        break;
+    case DISK_SEND:
+        if (s & (ATA_ERR | ATA_DF)) {
+            disk_errors++;
+            disk_head++;
+            disk_state = DISK_IDLE;
+        } else if (s & ATA_DRQ) {
+            w = (const u16 *) disk_data[disk_head % DISK_QUEUE];
+            for (i = 0; i < SECTOR / 2; i++)
+                outw(ATA_DATA, w[i]);
+            disk_state = DISK_SENT;
         }
-        cont_change = 0;
-        cont_enemyspawn = enemyspawn; 
-        cont_wallspawn = wallspawn; 
-        cont_enemymove = enemymove;  
-        cont_wallmove = wallmove; 
-        cont_start_dx = startwallchange; 
-    
-    // Initialize pieces
-    //Enemies
-    u8 i;
-        switch(l) {
-        case 1:
-            for (i = 0; i < N_ENEMYS; i++) {
-                enemy[i].i = 1;
-                enemy[i].hp = 3;
-                enemy[i].dmg = 1;     
-                enemy[i].alive = false; 
-                enemy[i].x = 0;   
-                enemy[i].y = 0; 
-            }
-            break;
-        case 2:
-            for (i = 0; i < N_ENEMYS; i++) {
-                enemy[i].i = 2;
-                enemy[i].hp = 999;
-                enemy[i].dmg = 1;     
-                enemy[i].alive = false; 
-                enemy[i].x = 0;   
-                enemy[i].y = 0; 
-            }
-            break;
-        case 3:
-            for (i = 0; i < N_ENEMYS; i++) {
-                enemy[i].i = 3;
-                enemy[i].hp = 3;
-                enemy[i].dmg = 1;     
-                enemy[i].alive = false; 
-                enemy[i].x = 0;   
-                enemy[i].y = 0; 
+        break;
+    case DISK_SENT:
+        if (s & (ATA_ERR | ATA_DF))
+            disk_errors++;
+        disk_head++;
+        disk_state = DISK_IDLE;
+        if (disk_head == disk_tail) {
+            outb(ATA_STATUS, ATA_FLUSH);
+            disk_state = DISK_FLUSH;
+        }
+        break;
+    case DISK_FLUSH:
+        disk_state = DISK_IDLE;
+        break;
+    }
+}
+
+/* Video Output */
+
+/* Seven possible display colors. Bright variations can be used by bitwise OR
+ * with BRIGHT (i.e. BRIGHT | BLUE). */
+enum color {
+    BLACK,
+    BLUE,
+    GREEN,
+    CYAN,
+    RED,
+    MAGENTA,
+    YELLOW,
+    GRAY,
+    BRIGHT
+};
+
+#define COLS (80)
+#define ROWS (25)
+u16 *const video = (u16*) 0xB8000;
+
+/* Graphics
+ *
+ * When booted through the VBE build with a 32 bpp linear framebuffer, the
+ * screen is drawn in graphics mode instead. Text cells written through putc()
+ * land in a shadow of the text screen, and the cells that changed are rendered
+ * into a back buffer as 8x16 pixel glyphs. Pieces are blitted on top as 16x16
+ * sprites, and only the dirty parts of the back buffer are copied out to the
+ * framebuffer by present(). */
+
+#define MULTIBOOT_MAGIC (0x2BADB002)
+
+/* Multiboot information structure, up to the framebuffer fields */
+struct multiboot_info {
+    u32 flags;
+    u32 mem_lower, mem_upper, boot_device, cmdline, mods_count, mods_addr;
+    u32 syms[4];
+    u32 mmap_length, mmap_addr, drives_length, drives_addr;
+    u32 config_table, boot_loader_name, apm_table;
+    u32 vbe_control_info, vbe_mode_info;
+    u16 vbe_mode, vbe_interface_seg, vbe_interface_off, vbe_interface_len;
+    u64 framebuffer_addr;
+    u32 framebuffer_pitch, framebuffer_width, framebuffer_height;
+    u8 framebuffer_bpp, framebuffer_type;
+};
+
+#define MULTIBOOT_VBE         (1 << 11)
+#define MULTIBOOT_FRAMEBUFFER (1 << 12)
+
+/* VBE mode information block, up to the linear framebuffer address. Boot
+ * loaders that predate the framebuffer fields only pass this. */
+struct vbe_mode_info {
+    u16 attributes;
+    u8 win_a, win_b;
+    u16 granularity, winsize, seg_a, seg_b;
+    u32 win_func;
+    u16 pitch, width, height;
+    u8 w_char, y_char, planes, bpp, banks, memory_model, bank_size;
+    u8 image_pages, reserved0;
+    u8 red_mask, red_pos, green_mask, green_pos, blue_mask, blue_pos;
+    u8 rsv_mask, rsv_pos, direct_color;
+    u32 framebuffer;
+};
+
+#define GLYPH_W (8)
+#define GLYPH_H (16)
+#define GFX_W   (COLS * GLYPH_W)
+#define GFX_H   (ROWS * GLYPH_H)
+
+bool gfx = false, has_sse2 = false;
+
+/* The framebuffer, and where the text screen is centred in it */
+u8 *fb;
+u32 fb_pitch, fb_x, fb_y;
+
+/* The back buffer, and the text cells it was last rendered from */
+u32 back[GFX_H][GFX_W];
+u16 cells[ROWS][COLS];
+
+/* Per text row, the span of columns to render and copy out (empty when
+ * dirty_lo > dirty_hi) */
+u8 dirty_lo[ROWS], dirty_hi[ROWS];
+bool gfx_dirty = false;
+
+/* enum color as 32 bpp pixels */
+const u32 palette[16] = {
+    0x000000, 0x0000AA, 0x00AA00, 0x00AAAA,
+    0xAA0000, 0xAA00AA, 0xAA5500, 0xAAAAAA,
+    0x555555, 0x5555FF, 0x55FF55, 0x55FFFF,
+    0xFF5555, 0xFF55FF, 0xFFFF55, 0xFFFFFF
+};
+
+/* 5x7 font for ' ' to '_', one byte per row with bit 4 leftmost. Lower case
+ * is drawn as upper case and anything else as a blank. */
+#define FONT_FIRST (' ')
+#define FONT_LAST  ('_')
+const u8 font[FONT_LAST - FONT_FIRST + 1][7] = {
+    {0x00,0x00,0x00,0x00,0x00,0x00,0x00}, {0x04,0x04,0x04,0x04,0x04,0x00,0x04},
+    {0x0A,0x0A,0x00,0x00,0x00,0x00,0x00}, {0x0A,0x0A,0x1F,0x0A,0x1F,0x0A,0x0A},
+    {0x04,0x0F,0x14,0x0E,0x05,0x1E,0x04}, {0x18,0x19,0x02,0x04,0x08,0x13,0x03},
+    {0x0C,0x12,0x14,0x08,0x15,0x12,0x0D}, {0x04,0x04,0x00,0x00,0x00,0x00,0x00},
+    {0x02,0x04,0x08,0x08,0x08,0x04,0x02}, {0x08,0x04,0x02,0x02,0x02,0x04,0x08},
+    {0x00,0x04,0x15,0x0E,0x15,0x04,0x00}, {0x00,0x04,0x04,0x1F,0x04,0x04,0x00},
+    {0x00,0x00,0x00,0x00,0x0C,0x04,0x08}, {0x00,0x00,0x00,0x1F,0x00,0x00,0x00},
+    {0x00,0x00,0x00,0x00,0x00,0x0C,0x0C}, {0x00,0x01,0x02,0x04,0x08,0x10,0x00},
+    {0x0E,0x11,0x13,0x15,0x19,0x11,0x0E}, {0x04,0x0C,0x04,0x04,0x04,0x04,0x0E},
+    {0x0E,0x11,0x01,0x02,0x04,0x08,0x1F}, {0x1F,0x02,0x04,0x02,0x01,0x11,0x0E},
+    {0x02,0x06,0x0A,0x12,0x1F,0x02,0x02}, {0x1F,0x10,0x1E,0x01,0x01,0x11,0x0E},
+    {0x06,0x08,0x10,0x1E,0x11,0x11,0x0E}, {0x1F,0x01,0x02,0x04,0x08,0x08,0x08},
+    {0x0E,0x11,0x11,0x0E,0x11,0x11,0x0E}, {0x0E,0x11,0x11,0x0F,0x01,0x02,0x0C},
+    {0x00,0x0C,0x0C,0x00,0x0C,0x0C,0x00}, {0x00,0x0C,0x0C,0x00,0x0C,0x04,0x08},
+    {0x02,0x04,0x08,0x10,0x08,0x04,0x02}, {0x00,0x00,0x1F,0x00,0x1F,0x00,0x00},
+    {0x08,0x04,0x02,0x01,0x02,0x04,0x08}, {0x0E,0x11,0x01,0x02,0x04,0x00,0x04},
+    {0x0E,0x11,0x01,0x0D,0x15,0x15,0x0E}, {0x0E,0x11,0x11,0x11,0x1F,0x11,0x11},
+    {0x1E,0x11,0x11,0x1E,0x11,0x11,0x1E}, {0x0E,0x11,0x10,0x10,0x10,0x11,0x0E},
+    {0x1C,0x12,0x11,0x11,0x11,0x12,0x1C}, {0x1F,0x10,0x10,0x1E,0x10,0x10,0x1F},
+    {0x1F,0x10,0x10,0x1E,0x10,0x10,0x10}, {0x0E,0x11,0x10,0x17,0x11,0x11,0x0F},
+    {0x11,0x11,0x11,0x1F,0x11,0x11,0x11}, {0x0E,0x04,0x04,0x04,0x04,0x04,0x0E},
+    {0x07,0x02,0x02,0x02,0x02,0x12,0x0C}, {0x11,0x12,0x14,0x18,0x14,0x12,0x11},
+    {0x10,0x10,0x10,0x10,0x10,0x10,0x1F}, {0x11,0x1B,0x15,0x15,0x11,0x11,0x11},
+    {0x11,0x11,0x19,0x15,0x13,0x11,0x11}, {0x0E,0x11,0x11,0x11,0x11,0x11,0x0E},
+    {0x1E,0x11,0x11,0x1E,0x10,0x10,0x10}, {0x0E,0x11,0x11,0x11,0x15,0x12,0x0D},
+    {0x1E,0x11,0x11,0x1E,0x14,0x12,0x11}, {0x0F,0x10,0x10,0x0E,0x01,0x01,0x1E},
+    {0x1F,0x04,0x04,0x04,0x04,0x04,0x04}, {0x11,0x11,0x11,0x11,0x11,0x11,0x0E},
+    {0x11,0x11,0x11,0x11,0x11,0x0A,0x04}, {0x11,0x11,0x11,0x15,0x15,0x15,0x0A},
+    {0x11,0x11,0x0A,0x04,0x0A,0x11,0x11}, {0x11,0x11,0x11,0x0A,0x04,0x04,0x04},
+    {0x1F,0x01,0x02,0x04,0x08,0x10,0x1F}, {0x0E,0x08,0x08,0x08,0x08,0x08,0x0E},
+    {0x00,0x10,0x08,0x04,0x02,0x01,0x00}, {0x0E,0x02,0x02,0x02,0x02,0x02,0x0E},
+    {0x04,0x0A,0x11,0x00,0x00,0x00,0x00}, {0x00,0x00,0x00,0x00,0x00,0x00,0x1F}
+};
+
+/* Mark text cell x, y to be rendered and copied out by the next present(). */
+void gfx_mark(u8 x, u8 y)
+{
+    if (x < dirty_lo[y])
+        dirty_lo[y] = x;
+    if (x > dirty_hi[y])
+        dirty_hi[y] = x;
+    gfx_dirty = true;
+}
+
+/* Mark the text cells under the pixel rectangle x, y, w, h (clipped to the
+ * screen). */
+void gfx_mark_rect(s32 x, s32 y, s32 w, s32 h)
+{
+    s32 cx, cy, x1 = x + w, y1 = y + h;
+    if (x < 0)
+        x = 0;
+    if (y < 0)
+        y = 0;
+    if (x1 > GFX_W)
+        x1 = GFX_W;
+    if (y1 > GFX_H)
+        y1 = GFX_H;
+    for (cy = y / GLYPH_H; cy * GLYPH_H < y1; cy++)
+        for (cx = x / GLYPH_W; cx * GLYPH_W < x1; cx++)
+            gfx_mark(cx, cy);
+}
+
+/* Render text cell x, y into the back buffer. */
+void gfx_render_cell(u8 x, u8 y)
+{
+    u16 z = cells[y][x];
+    u8 c = z & 0xFF, r, col, bits;
+    u32 fg = palette[(z >> 8) & 0xF], bg = palette[(z >> 12) & 0x7];
+    u32 *p = &back[y * GLYPH_H][x * GLYPH_W];
+    const u8 *glyph;
+
+    if (c >= 'a' && c <= 'z')
+        c -= 'a' - 'A';
+    glyph = c >= FONT_FIRST && c <= FONT_LAST ? font[c - FONT_FIRST] : font[0];
+
+    /* Each font row is drawn two pixels high, one pixel in from the top left */
+    for (r = 0; r < GLYPH_H; r++, p += GFX_W) {
+        bits = r >= 1 && r < 15 ? glyph[(r - 1) / 2] << 2 : 0;
+        for (col = 0; col < GLYPH_W; col++)
+            p[col] = bits & (0x80 >> col) ? fg : bg;
+    }
+}
+
+/* Four pixels, for the SSE2 paths. Only 4-byte alignment is assumed, so
+ * accesses through it compile to unaligned loads and stores. */
+typedef u32 v4u __attribute__((vector_size(16), aligned(4)));
+
+/* Copy n pixels from s to d. */
+__attribute__((target("sse2")))
+static void copy_row_sse2(u32 *d, const u32 *s, u32 n)
+{
+    for (; n >= 4; n -= 4, d += 4, s += 4)
+        *(v4u *) d = *(const v4u *) s;
+    while (n--)
+        *d++ = *s++;
+}
+
+/* Copy n pixels from s to d where mask m is set, leaving the rest of d. */
+__attribute__((target("sse2")))
+static void blend_row_sse2(u32 *d, const u32 *s, const u32 *m, u32 n)
+{
+    for (; n >= 4; n -= 4, d += 4, s += 4, m += 4)
+        *(v4u *) d = (*(v4u *) d & ~*(const v4u *) m)
+                   | (*(const v4u *) s & *(const v4u *) m);
+    for (; n; n--, d++, s++, m++)
+        *d = (*d & ~*m) | (*s & *m);
+}
+
+void copy_row(u32 *d, const u32 *s, u32 n)
+{
+    if (has_sse2)
+        copy_row_sse2(d, s, n);
+    else while (n--)
+        *d++ = *s++;
+}
+
+void blend_row(u32 *d, const u32 *s, const u32 *m, u32 n)
+{
+    if (has_sse2)
+        blend_row_sse2(d, s, m, n);
+    else for (; n; n--, d++, s++, m++)
+        *d = (*d & ~*m) | (*s & *m);
+}
+
+/* Copy the dirty spans of the back buffer out to the framebuffer and mark
+ * everything clean. */
+void gfx_flush(void)
+{
+    u8 y;
+    u32 r, x, w;
+    for (y = 0; y < ROWS; y++) {
+        if (dirty_lo[y] > dirty_hi[y])
+            continue;
+        x = dirty_lo[y] * GLYPH_W;
+        w = (dirty_hi[y] - dirty_lo[y] + 1) * GLYPH_W;
+        for (r = y * GLYPH_H; r < (u32) (y + 1) * GLYPH_H; r++)
+            copy_row((u32 *) (fb + (fb_y + r) * fb_pitch) + fb_x + x,
+                     &back[r][x], w);
+        dirty_lo[y] = COLS;
+        dirty_hi[y] = 0;
+    }
+    gfx_dirty = false;
+}
+
+/* Enable SSE if the CPU has SSE2, which the blitter then uses. */
+void sse_init(void)
+{
+    u32 a, b, c, d;
+    uptr cr; /* Register sized, for the x86-64 builds */
+    asm("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (1));
+    if (!(d & (1 << 26)))
+        return;
+    asm volatile("mov %%cr0, %0" : "=r" (cr));
+    cr = (cr & ~(1 << 2)) | (1 << 1); /* No x87 emulation, monitor coprocessor */
+    asm volatile("mov %0, %%cr0" : : "r" (cr));
+    asm volatile("mov %%cr4, %0" : "=r" (cr));
+    cr |= (1 << 9) | (1 << 10); /* OSFXSR, OSXMMEXCPT */
+    asm volatile("mov %0, %%cr4" : : "r" (cr));
+    has_sse2 = true;
+}
+
+/* Switch to graphics mode if the boot loader set up a 32 bpp linear
+ * framebuffer of at least GFX_W x GFX_H, otherwise stay in text mode. */
+void gfx_init(const struct multiboot_info *mbi, u32 magic)
+{
+    u32 w, h, bpp, y;
+    const struct vbe_mode_info *vbe;
+
+    if (magic != MULTIBOOT_MAGIC)
+        return;
+    if (mbi->flags & MULTIBOOT_FRAMEBUFFER) {
+        if (mbi->framebuffer_type != 1 || mbi->framebuffer_addr >> 32)
+            return;
+        fb = (u8 *) (uptr) mbi->framebuffer_addr;
+        fb_pitch = mbi->framebuffer_pitch;
+        w = mbi->framebuffer_width;
+        h = mbi->framebuffer_height;
+        bpp = mbi->framebuffer_bpp;
+    } else if (mbi->flags & MULTIBOOT_VBE) {
+        vbe = (const struct vbe_mode_info *) (uptr) mbi->vbe_mode_info;
+        fb = (u8 *) (uptr) vbe->framebuffer;
+        fb_pitch = vbe->pitch;
+        w = vbe->width;
+        h = vbe->height;
+        bpp = vbe->bpp;
+    } else return;
+    if (bpp != 32 || w < GFX_W || h < GFX_H)
+        return;
+
+    sse_init();
+    fb_x = (w - GFX_W) / 2;
+    fb_y = (h - GFX_H) / 2;
+    for (y = 0; y < h; y++)
+        memset(fb + y * fb_pitch, 0, w * 4);
+    for (y = 0; y < ROWS; y++) {
+        dirty_lo[y] = COLS;
+        dirty_hi[y] = 0;
+    }
+    gfx = true;
+}
+
+/* Where putc() draws instead of the screen, as text cells, if set. The
+ * sessions build draws each session's screen into a buffer of its own. */
+u16 *screen_target = 0;
+
+/* Display a character at x, y in fg foreground color and bg background color.
+ */
+void putc(u8 x, u8 y, enum color fg, enum color bg, char c)
+{
+    u16 z = (bg << 12) | (fg << 8) | (u8) c;
+    if (screen_target)
+        screen_target[y * COLS + x] = z;
+    else if (gfx) {
+        if (cells[y][x] != z) {
+            cells[y][x] = z;
+            gfx_mark(x, y);
+        }
+    } else video[y * COLS + x] = z;
+}
+
+/* Display a string starting at x, y in fg foreground color and bg background
+ * color. Characters in the string are not interpreted (e.g \n, \b, \t, etc.).
+ * */
+void puts(u8 x, u8 y, enum color fg, enum color bg, const char *s)
+{
+    for (; *s; s++, x++)
+        putc(x, y, fg, bg, *s);
+}
+
+/* Incremented by clear(), so that widgets drawn before know to redraw */
+u32 screen_epoch = 1;
+
+/* Clear the screen to bg backround color. */
+void clear(enum color bg)
+{
+    u8 x, y;
+    screen_epoch++;
+    for (y = 0; y < ROWS; y++)
+        for (x = 0; x < COLS; x++)
+            putc(x, y, bg, bg, ' ');
+}
+
+/* Sprites */
+
+/* Pieces as drawn on screen. In text mode a sprite is two characters; in
+ * graphics mode it is a 16x16 image where '#' is drawn in fg, '+' in bg and
+ * '.' is transparent. */
+enum sprite {
+    SPRITE_PLAYER,
+    SPRITE_LASER,
+    SPRITE_ENEMY_1,
+    SPRITE_ENEMY_2,
+    SPRITE_ENEMY_3,
+    SPRITE_ENEMY_4,
+    SPRITE_WALL_1,
+    SPRITE_WALL_2,
+    SPRITE_WALL_3,
+    SPRITE_WALL_4,
+    SPRITE__LENGTH
+};
+
+#define SPRITE_W (16)
+#define SPRITE_H (16)
+
+const char *const art_player[SPRITE_H] = {
+    ".......##.......", "......#++#......", "......#++#......", ".....#++++#.....",
+    ".....#+##+#.....", "....#++##++#....", "....#++++++#....", "...#++++++++#...",
+    "..#++++++++++#..", ".#++++#++#++++#.", "#+++++#++#+++++#", "#++++##++##++++#",
+    "#+++#..##..#+++#", "#++#........#++#", "###..........###", "................"
+};
+
+const char *const art_laser[SPRITE_H] = {
+    "....##....##....", "....##....##....", "....##....##....", "....##....##....",
+    "....##....##....", "....##....##....", "....##....##....", "....##....##....",
+    "....##....##....", "....##....##....", "....##....##....", "....##....##....",
+    "....##....##....", "....##....##....", "....##....##....", "....##....##...."
+};
+
+const char *const art_fighter[SPRITE_H] = {
+    "#..............#", "##............##", "#+#..........#+#", "#++#........#++#",
+    "#+++#......#+++#", ".#+++#....#+++#.", ".#++++####++++#.", "..#++++++++++#..",
+    "..#+++####+++#..", "...#++#..#++#...", "...#++#..#++#...", "....#++##++#....",
+    ".....#++++#.....", "......#++#......", ".......##.......", "................"
+};
+
+const char *const art_asteroid[SPRITE_H] = {
+    "................", ".....######.....", "...##########...", "..####++#####...",
+    ".######+#######.", ".##############.", "###+#######+####", "################",
+    "#######++#######", "####+###########", ".#############+.", ".##############.",
+    "..###+#######...", "...##########...", ".....######.....", "................"
+};
+
+const char *const art_xwing[SPRITE_H] = {
+    "##............##", "#+#..........#+#", ".#+#........#+#.", "..#+#......#+#..",
+    "...#+#....#+#...", "....#+#..#+#....", ".....#+##+#.....", "......#++#......",
+    "......#++#......", ".....#+##+#.....", "....#+#..#+#....", "...#+#....#+#...",
+    "..#+#......#+#..", ".#+#........#+#.", "#+#..........#+#", "##............##"
+};
+
+const char *const art_satellite[SPRITE_H] = {
+    "................", "###....##....###", "#+#....##....#+#", "#+#...####...#+#",
+    "#+#..#++++#..#+#", "#+####++++####+#", "#+#..#++++#..#+#", "#+#...####...#+#",
+    "#+#....##....#+#", "###....##....###", ".......##.......", "......####......",
+    ".....##..##.....", "....##....##....", "................", "................"
+};
+
+const char *const art_wall[SPRITE_H] = {
+    "################", "+++#+++++++#++++", "+++#+++++++#++++", "+++#+++++++#++++",
+    "################", "#+++++++#+++++++", "#+++++++#+++++++", "#+++++++#+++++++",
+    "################", "+++#+++++++#++++", "+++#+++++++#++++", "+++#+++++++#++++",
+    "################", "#+++++++#+++++++", "#+++++++#+++++++", "#+++++++#+++++++"
+};
+
+struct Sprite {
+    const char *text;
+    enum color fg, bg;
+    const char *const *art;
+};
+
+const struct Sprite sprites[SPRITE__LENGTH] = {
+    [SPRITE_PLAYER]  = { "^^", BRIGHT,  YELLOW,  art_player },
+    [SPRITE_LASER]   = { "||", RED,     BLACK,   art_laser },
+    [SPRITE_ENEMY_1] = { "VV", RED,     GRAY,    art_fighter },
+    [SPRITE_ENEMY_2] = { "OO", YELLOW,  BLACK,   art_asteroid },
+    [SPRITE_ENEMY_3] = { "XX", GRAY,    BLUE,    art_xwing },
+    [SPRITE_ENEMY_4] = { "S)", YELLOW,  GRAY,    art_satellite },
+    [SPRITE_WALL_1]  = { "[]", MAGENTA, RED,     art_wall },
+    [SPRITE_WALL_2]  = { "[]", BLACK,   YELLOW,  art_wall },
+    [SPRITE_WALL_3]  = { "[]", RED,     BLUE,    art_wall },
+    [SPRITE_WALL_4]  = { "[]", CYAN,    MAGENTA, art_wall }
+};
+
+/* The characters each sprite is drawn with in text mode */
+char sprite_text[SPRITE__LENGTH][3];
+
+/* Sprites converted to pixels and a mask of the opaque ones at boot, so that
+ * blitting is a masked copy of whole rows. */
+u32 sprite_px[SPRITE__LENGTH][SPRITE_H][SPRITE_W];
+u32 sprite_mask[SPRITE__LENGTH][SPRITE_H][SPRITE_W];
+
+/* The sprites drawn since the last sprite_begin(), in pixels */
+#define N_SPRITES (1 + N_ENEMYS + N_LASERS + WELL_WIDTH * WELL_HEIGHT)
+struct {
+    s16 x, y;
+    u8 id;
+} drawn[N_SPRITES];
+u32 n_drawn = 0;
+
+/* Convert the sprite art into sprite_px and sprite_mask. */
+void sprite_init(void)
+{
+    u32 i, x, y;
+    char c;
+    for (i = 0; i < SPRITE__LENGTH; i++) {
+        sprite_text[i][0] = sprites[i].text[0];
+        sprite_text[i][1] = sprites[i].text[1];
+        for (y = 0; y < SPRITE_H; y++) {
+            for (x = 0; x < SPRITE_W; x++) {
+                c = sprites[i].art[y][x];
+                sprite_px[i][y][x] = c == '#' ? palette[sprites[i].fg]
+                                   : c == '+' ? palette[sprites[i].bg] : 0;
+                sprite_mask[i][y][x] = c == '.' ? 0 : 0xFFFFFFFF;
             }
+        }
+    }
+}
+
+/* Blit sprite id at pixel x, y of the back buffer, clipped to it. */
+void blit(enum sprite id, s32 x, s32 y)
+{
+    s32 sx = 0, sy = 0, w = SPRITE_W, h = SPRITE_H;
+    if (x < 0) {
+        sx = -x;
+        w += x;
+        x = 0;
+    }
+    if (y < 0) {
+        sy = -y;
+        h += y;
+        y = 0;
+    }
+    if (x + w > GFX_W)
+        w = GFX_W - x;
+    if (y + h > GFX_H)
+        h = GFX_H - y;
+    for (; h > 0; h--, y++, sy++)
+        blend_row(&back[y][x], &sprite_px[id][sy][sx], &sprite_mask[id][sy][sx],
+                  w);
+}
+
+/* Start a new frame of sprites. In graphics mode, the cells under the
+ * previous frame's sprites are redrawn on the next present(). */
+void sprite_begin(void)
+{
+    u32 i;
+    if (screen_target)
+        return;
+    for (i = 0; i < n_drawn; i++)
+        gfx_mark_rect(drawn[i].x, drawn[i].y, SPRITE_W, SPRITE_H);
+    n_drawn = 0;
+}
+
+/* Draw sprite id at text cell x, y, as text if not drawing to the screen. */
+void sprite(s8 x, s8 y, enum sprite id)
+{
+    if (!gfx || screen_target) {
+        puts(x, y, sprites[id].fg, sprites[id].bg, sprite_text[id]);
+        return;
+    }
+    if (n_drawn == N_SPRITES)
+        return;
+    drawn[n_drawn].x = x * GLYPH_W;
+    drawn[n_drawn].y = y * GLYPH_H;
+    drawn[n_drawn].id = id;
+    gfx_mark_rect(drawn[n_drawn].x, drawn[n_drawn].y, SPRITE_W, SPRITE_H);
+    n_drawn++;
+}
+
+/* In graphics mode, render the text cells that changed since the last call,
+ * blit the sprites over any of them, and copy the result out to the
+ * framebuffer. Does nothing in text mode or if nothing changed. */
+void present(void)
+{
+    u32 i;
+    s32 cy, cx0, cx1;
+    u8 x, y;
+    bool hit;
+
+    if (!gfx || !gfx_dirty)
+        return;
+    for (y = 0; y < ROWS; y++)
+        for (x = dirty_lo[y]; x <= dirty_hi[y] && x < COLS; x++)
+            gfx_render_cell(x, y);
+
+    /* Sprites are only ever redrawn over freshly rendered cells */
+    for (i = 0; i < n_drawn; i++) {
+        cx0 = drawn[i].x / GLYPH_W;
+        cx1 = (drawn[i].x + SPRITE_W - 1) / GLYPH_W;
+        hit = false;
+        for (cy = drawn[i].y / GLYPH_H;
+             cy <= (drawn[i].y + SPRITE_H - 1) / GLYPH_H && !hit; cy++)
+            if (cy >= 0 && cy < ROWS && dirty_lo[cy] <= cx1
+                    && dirty_hi[cy] >= cx0 && dirty_lo[cy] <= dirty_hi[cy])
+                hit = true;
+        if (hit)
+            blit(drawn[i].id, drawn[i].x, drawn[i].y);
+    }
+    gfx_flush();
+}
+
+/* Font
+ *
+ * In text mode, sprites are drawn with custom glyphs rather than plain ASCII:
+ * each sprite's art becomes a pair of 8x16 characters ('#' set, anything else
+ * clear) loaded into the VGA character set in plane 2. The pairs are taken
+ * from 0xC0-0xDF, where the VGA repeats the eighth pixel column into the
+ * ninth, so that the two halves join up. */
+
+#define GLYPH_FIRST (0xC0)
+#define GLYPH_LAST  (0xDF)
+
+u8 *const vga_font = (u8 *) 0xA0000;
+
+/* Read and write indexed VGA registers (sequencer at 0x3C4, graphics
+ * controller at 0x3CE). */
+static inline u8 vga_read(u16 port, u8 index)
+{
+    outb(port, index);
+    return inb(port + 1);
+}
+
+static inline void vga_write(u16 port, u8 index, u8 value)
+{
+    outb(port, index);
+    outb(port + 1, value);
+}
+
+/* Load the sprite glyphs into the character set and switch the sprites over
+ * to them. Sprites sharing art share glyphs. */
+void font_load(void)
+{
+    u8 seq2 = vga_read(0x3C4, 2), seq4 = vga_read(0x3C4, 4);
+    u8 gc4 = vga_read(0x3CE, 4), gc5 = vga_read(0x3CE, 5), gc6 = vga_read(0x3CE, 6);
+    u32 i, j, r, x, half;
+    u8 c = GLYPH_FIRST, bits;
+    u8 *glyph;
+
+    /* Map plane 2 alone at 0xA0000, without odd/even addressing */
+    vga_write(0x3C4, 2, 0x04);
+    vga_write(0x3C4, 4, 0x07);
+    vga_write(0x3CE, 4, 0x02);
+    vga_write(0x3CE, 5, 0x00);
+    vga_write(0x3CE, 6, 0x04);
+
+    for (i = 0; i < SPRITE__LENGTH; i++) {
+        for (j = 0; j < i && sprites[j].art != sprites[i].art; j++);
+        if (j < i) {
+            sprite_text[i][0] = sprite_text[j][0];
+            sprite_text[i][1] = sprite_text[j][1];
+            continue;
+        }
+        if (c + 1 > GLYPH_LAST)
             break;
-        case 4:
-            for (i = 0; i < N_ENEMYS; i++) {
-                enemy[i].i = 4;
-                enemy[i].hp = 999;
-                enemy[i].dmg = 1;     
-                enemy[i].alive = false; 
-                enemy[i].x = 0;   
-                enemy[i].y = 0; 
+        for (half = 0; half < 2; half++) {
+            /* Each character has 32 bytes of rows, of which 16 are shown */
+            glyph = vga_font + (c + half) * 32;
+            for (r = 0; r < SPRITE_H; r++) {
+                bits = 0;
+                for (x = 0; x < 8; x++)
+                    if (sprites[i].art[r][half * 8 + x] == '#')
+                        bits |= 0x80 >> x;
+                glyph[r] = bits;
             }
-            break;  
         }
+        sprite_text[i][0] = c;
+        sprite_text[i][1] = c + 1;
+        c += 2;
+    }
 
-    //Wall
-            for (i = 0; i < N_WALLS; i++) {
-                wall[i].i = 1;
-                wall[i].hp = 999;
-                wall[i].dmg = 1;     
-                wall[i].alive = false; 
-                wall[i].x = 0;   
-                wall[i].y = 0; 
-            }
-    //Player Laser
-            for (i = 0; i < N_LASERS; i++) {
-                laser[i].i = 1;
-                laser[i].hp = 999;
-                laser[i].dmg = 1;     
-                laser[i].alive = false; 
-                laser[i].x = 0;   
-                laser[i].y = 0; 
-            }
+    vga_write(0x3C4, 2, seq2);
+    vga_write(0x3C4, 4, seq4);
+    vga_write(0x3CE, 4, gc4);
+    vga_write(0x3CE, 5, gc5);
+    vga_write(0x3CE, 6, gc6);
+}
+
+/* Keyboard Input */
+
+#define KEY_1     (0x2)
+#define KEY_2     (0x3)
+#define KEY_3     (0x4)
+#define KEY_4     (0x5)
+#define KEY_A     (0x1E)
+#define KEY_D     (0x20)
+#define KEY_H     (0x23)
+#define KEY_P     (0x19)
+#define KEY_R     (0x13)
+#define KEY_S     (0x1F)
+#define KEY_UP    (0x48)
+#define KEY_DOWN  (0x50)
+#define KEY_LEFT  (0x4B)
+#define KEY_RIGHT (0x4D)
+#define KEY_ENTER (0x1C)
+#define KEY_SPACE (0x39)
+#define KEY_F1    (0x3B) /* F2 to F10 follow */
+
+/* Set in the scancode of a key being released */
+#define KEY_RELEASE (0x80)
+
+/* The CPU tick at which scan() last returned a key event */
+u64 scan_stamp = 0;
+
+/* Return the scancode of the current up or down key if it has changed since
+ * the last call, otherwise returns 0. When called on every iteration of the
+ * main loop, returns non-zero on a key event. */
+u8 scan(void)
+{
+    static u8 key = 0;
+    u8 scan = inb(0x60);
+    if (scan != key) {
+        scan_stamp = rdtsc();
+        return key = scan;
+    } else return 0;
+}
+
+/* PC Speaker */
+
+/* Set the frequency of the PC speaker through timer 2 of the programmable
+ * interrupt timer (PIT). */
+void pcspk_freq(u32 hz)
+{
+    u32 div = 1193180 / hz;
+    outb(0x43, 0xB6);
+    outb(0x42, (u8) div);
+    outb(0x42, (u8) (div >> 8));
+}
+
+/* Enable timer 2 of the PIT to drive the PC speaker. */
+void pcspk_on(void)
+{
+    outb(0x61, inb(0x61) | 0x3);
+}
+
+/* Disable timer 2 of the PIT to drive the PC speaker. */
+void pcspk_off(void)
+{
+    outb(0x61, inb(0x61) & 0xFC);
+}
+
+/* Formatting */
+
+/* Format n in radix r (2-16) as a w length string. */
+char *itoa(u32 n, u8 r, u8 w)
+{
+    static const char d[16] = "0123456789ABCDEF";
+    static char s[34];
+    s[33] = 0;
+    u8 i = 33;
+    do {
+        i--;
+        s[i] = d[n % r];
+        n /= r;
+    } while (i > 33 - w);
+    return (char *) (s + i);
+}
+
+/* Write label and the decimal value v to COM1. */
+void serial_putn(const char *label, u32 v)
+{
+    const char *s = itoa(v, 10, 10);
+    while (*s == '0' && s[1])
+        s++;
+    serial_puts(label);
+    serial_puts(s);
+}
+
+/* Random */
+
+/* State of the xorshift generator behind rand(). Seeded from the CPU ticks
+ * since boot, and part of the game state so a game can be replayed (or
+ * simulated elsewhere) from its seed. */
+u32 seed = 1;
+
+/* Seed rand(). Zero is a fixed point of xorshift, so it is replaced by one. */
+void srand(u32 s)
+{
+    seed = s ? s : 1;
+}
+
+/* Generate a random number from 0 inclusive to range exclusive. */
+u32 rand(u32 range)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed % range;
+}
+
+/* Shuffle an array of bytes arr of length len in-place using Fisher-Yates. */
+void shuffle(u8 arr[], u32 len)
+{
+    u32 i, j;
+    u8 t;
+    for (i = len - 1; i > 0; i--) {
+        j = rand(i + 1);
+        t = arr[i];
+        arr[i] = arr[j];
+        arr[j] = t;
+    }
+}
+
+/* Input latency
+ *
+ * When a key changes the game through move() or spawn_playerlaser(), the tick
+ * its scancode was read at is kept until the frame showing the change has been
+ * written out to video memory, and the time in between is recorded. */
+
+/* The scan_stamp of the key being handled, 0 outside the key handler (for
+ * the bot, say), and that of the oldest input not yet on screen, or 0 */
+u64 input_stamp = 0, latency_from = 0;
+
+/* The most recent LATENCY_SAMPLES latencies in microseconds, and their
+ * median, 99th percentile and maximum */
+u32 latency_us[LATENCY_SAMPLES];
+u32 latency_count = 0;
+u32 latency_p50 = 0, latency_p99 = 0, latency_max = 0;
+
+/* Note that the key being handled has changed the game. */
+void latency_input(void)
+{
+    if (input_stamp && !latency_from)
+        latency_from = input_stamp;
+}
+
+/* Record the latency of the pending input, now that it is on screen, and
+ * update the statistics. Every LATENCY_REPORT inputs, they are sent to COM1 as
+ * well. */
+void latency_shown(void)
+{
+    static u32 sorted[LATENCY_SAMPLES];
+    u64 t = rdtsc() - latency_from;
+    u32 tpus = (u32) tpms / 1000, n, i, j, v;
+
+    latency_from = 0;
+    if (!tpus)
+        tpus = 1;
+    latency_us[latency_count++ % LATENCY_SAMPLES] =
+        t >> 32 ? 0xFFFFFFFF / tpus : (u32) t / tpus;
+
+    /* Inputs are few and far between, so a fresh insertion sort will do */
+    n = latency_count < LATENCY_SAMPLES ? latency_count : LATENCY_SAMPLES;
+    for (i = 0; i < n; i++) {
+        v = latency_us[i];
+        for (j = i; j && sorted[j - 1] > v; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = v;
+    }
+    latency_p50 = sorted[n / 2];
+    latency_p99 = sorted[n * 99 / 100];
+    latency_max = sorted[n - 1];
+
+    if (latency_count % LATENCY_REPORT == 0) {
+        serial_putn("input latency us: p50 ", latency_p50);
+        serial_putn(" p99 ", latency_p99);
+        serial_putn(" max ", latency_max);
+        serial_putn(" over ", n);
+        serial_puts(" inputs\n");
+    }
+}
+
+/* Watchdog
+ *
+ * Every main loop iteration is timed phase by phase. One that takes longer
+ * than FRAME_BUDGET microseconds is counted, traced, and logged to COM1 with
+ * the phase that took longest, at most once a second (the rest are counted
+ * into the next line). */
+
+enum frame_phase {
+    FRAME_STEP,
+    FRAME_BOT,
+    FRAME_INPUT,
+    FRAME_CONSOLE,
+    FRAME_UPDATE,
+    FRAME_EFFECTS,
+    FRAME_REWIND,
+    FRAME_DISK,
+    FRAME_DRAW,
+    FRAME_PRESENT,
+    FRAME__LENGTH
+};
+
+const char *const frame_phase_names[FRAME__LENGTH] = {
+    "step", "bot", "input", "console", "update", "effects", "rewind", "disk",
+    "draw", "present"
+};
+
+/* CPU ticks each phase took in the current iteration, the ticks at which the
+ * iteration and the current phase started, and the current phase
+ * (FRAME__LENGTH outside the main loop) */
+u64 frame_ticks[FRAME__LENGTH];
+u64 frame_start, frame_mark;
+enum frame_phase frame_phase = FRAME__LENGTH;
+
+/* Frames drawn, iterations over budget, and those not logged yet */
+u32 draws = 0, overruns = 0, overruns_unlogged = 0;
+
+/* Convert CPU ticks t to microseconds, or 0 before the timing is
+ * calibrated. */
+u32 ticks_us(u64 t)
+{
+    u32 tpus = (u32) tpms / 1000;
+    if (!tpus)
+        return 0;
+    if (t >> 32)
+        return (u32) (t >> 16) / tpus << 16; /* Coarser, past a second or so */
+    return (u32) t / tpus;
+}
+
+/* Start timing a main loop iteration, in phase FRAME_STEP. */
+void frame_begin(void)
+{
+    frame_start = frame_mark = rdtsc();
+    frame_phase = FRAME_STEP;
+}
+
+/* Finish timing the current phase and go on to phase p. */
+void frame_enter(enum frame_phase p)
+{
+    u64 t = rdtsc();
+    frame_ticks[frame_phase] = t - frame_mark;
+    frame_mark = t;
+    frame_phase = p;
+}
+
+/* Finish timing the iteration, and report it if it went over budget. */
+void frame_end(void)
+{
+    u32 p, worst = 0, us;
+
+    frame_enter(FRAME__LENGTH);
+    us = ticks_us(frame_mark - frame_start);
+    if (us <= FRAME_BUDGET)
+        return;
+    for (p = 1; p < FRAME__LENGTH; p++)
+        if (frame_ticks[p] > frame_ticks[worst])
+            worst = p;
+    overruns++;
+    trace(TRACE_OVERRUN, worst, us);
+    if (!interval(TIMER_WATCHDOG, 1000)) {
+        overruns_unlogged++;
+        return;
+    }
+    serial_putn("overrun: ", us);
+    serial_puts(" us, ");
+    serial_puts(frame_phase_names[worst]);
+    serial_putn(" ", ticks_us(frame_ticks[worst]));
+    serial_puts(" us");
+    if (overruns_unlogged) {
+        serial_putn(", and ", overruns_unlogged);
+        serial_puts(" more since the last");
+        overruns_unlogged = 0;
+    }
+    serial_puts("\n");
+}
+
+//##################################################################################################################################################################################
+//----------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//LOGICA DEL JUEGO
+//----------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//##################################################################################################################################################################################
+
+/* The terrain, as a ring of rows that scrolls down one row at a time: row y
+ * of the well, counting from the top, is WELL_ROW(y). Each cell holds the
+ * level its wall was generated at, or 0 if it is open. */
+u8 well[WELL_HEIGHT][WELL_WIDTH];
+u8 well_top = 0;
+
+#define WELL_ROW(y) (well[(well_top + (y)) % WELL_HEIGHT])
+
+/* Distance field the enemys steer by, a ring aligned with well: each open cell
+ * holds the number of rows from it up to the nearest wall above it, up to
+ * FLOW_DEPTH, and each wall 0. The well scrolls faster than the enemys fall,
+ * so this is how long a piece in the cell has before a wall comes down on it.
+ * Rows above the top are taken to be open. */
+u8 flow[WELL_HEIGHT][WELL_WIDTH];
+
+#define FLOW_ROW(y) (flow[(well_top + (y)) % WELL_HEIGHT])
+
+/* Screen column of the well's first cell. Each cell is two columns wide, and
+ * pieces are placed by screen column. */
+#define WELL_X (2)
+
+/* Positions are fixed point: a piece is at x + fx / FIX_ONE, y + fy / FIX_ONE,
+ * where x, y is the cell it is drawn and collides in. Velocities are in
+ * 1 / FIX_ONE of a cell per tick (see advance()). */
+#define FIX_SHIFT (16)
+#define FIX_ONE   (1 << FIX_SHIFT)
+#define FIX_MASK  (FIX_ONE - 1)
+
+/* Velocity of something that moves one cell every period main loop
+ * iterations */
+#define FIX_VELOCITY(period) ((s32) (FIX_ONE * tuning.tick / (period)))
+
+/* Lasers climb one cell per update(). */
+#define LASER_VY (-FIX_ONE)
+
+struct Piece {
+    u32 i; /* Index*/
+    u32 hp; /*HP*/
+    u32 dmg; /*Damage*/
+    bool alive; /*State*/
+    s8 x, y; /* Coordinates */
+    u16 fx, fy; /* Fractions of a cell past x, y */
+    s32 vx, vy; /* Velocity */
+};
+
+    struct Piece enemy[N_ENEMYS];
+    struct Piece laser[N_LASERS];
+    struct Piece player;
+
+u32 score = 0, level = 1, speed = INITIAL_SPEED;
+
+bool paused = false, game_over = false;
+
+u32 wallmove = WALLMOVE, enemyspawn = ENEMYSPAWN, enemymove = ENEMYMOVE;
+
+/* The settings from config.h that the console can change at run time. They
+ * are left out of struct State: a game changed with them no longer replays
+ * the same. */
+struct {
+    u32 enemyspawn, enemymove, wallmove, tick, corridor_run;
+    u32 score_kill, score_dodge, score_level;
+    u32 enemys, lasers;
+    u32 particle_budget, bot_budget;
+} tuning = {
+    .enemyspawn = ENEMYSPAWN,
+    .enemymove = ENEMYMOVE,
+    .wallmove = WALLMOVE,
+    .tick = TICK,
+    .corridor_run = CORRIDOR_RUN,
+    .score_kill = SCORE_KILL,
+    .score_dodge = SCORE_DODGE,
+    .score_level = SCORE_LEVEL,
+    .enemys = N_ENEMYS,
+    .lasers = N_LASERS,
+    .particle_budget = PARTICLE_BUDGET,
+    .bot_budget = BOT_BUDGET
+};
+
+/* Whether the console has changed any of tuning since boot */
+bool retuned = false;
+
+u32 cont_enemyspawn = 0, cont_tick = 0;
+
+/* Velocity of newly spawned enemys, and the well's scroll velocity and the
+ * fraction of a row it has scrolled past well_top */
+s32 enemy_vy = 0, well_vy = 0;
+u32 well_fy = 0;
+
+/* Corridor generator: the first open cell and the number of open cells in the
+ * next row, and the direction and remaining rows of the current drift */
+u8 corridor_x = 0, corridor_w = 0;
+s8 corridor_dir = 0;
+u8 corridor_run = 0;
+
+/* Particles
+ *
+ * Explosions, debris and thruster trails are purely visual: they live in their
+ * own ring of N_PARTICLES, draw from their own generator and are left out of
+ * struct State, so they never change how the game plays. New particles go in
+ * at particle_head, overwriting the oldest once the ring is full, and the live
+ * ones are the particle_count before it. Updating and drawing run newest
+ * first, in chunks, and whatever is left when PARTICLE_BUDGET runs out is the
+ * oldest and is dropped. */
+
+enum particle_kind {
+    PARTICLE_SPARK,
+    PARTICLE_DEBRIS,
+    PARTICLE_TRAIL,
+    PARTICLE__LENGTH
+};
+
+/* Per kind: the top speed along x in fixed-point columns per update (half
+ * that along y, as cells are twice as tall as wide), the fall added to vy on
+ * every update, the longest life in updates (at least 4), and how it looks
+ * from fading out to fresh. */
+const struct {
+    s32 speed, gravity;
+    u32 life;
+    enum color fg[3];
+    char c[3];
+} particle_kinds[PARTICLE__LENGTH] = {
+    [PARTICLE_SPARK]  = {FIX_ONE,     0,           8,
+                         {RED, BRIGHT | RED, BRIGHT | YELLOW}, ".+*"},
+    [PARTICLE_DEBRIS] = {FIX_ONE / 2, FIX_ONE / 8, 16,
+                         {BRIGHT | BLACK, GRAY, GRAY}, ".,o"},
+    [PARTICLE_TRAIL]  = {FIX_ONE / 2, 0,           4,
+                         {BLUE, BLUE, BRIGHT | CYAN}, "..'"}
+};
+
+struct Particle {
+    s32 x, y, vx, vy, ay; /* Screen position in fixed point, velocity, fall */
+    u32 life, max; /* Updates left, 0 once dead, out of max */
+    enum particle_kind kind;
+};
+
+#define PARTICLE_MASK  (N_PARTICLES - 1)
+#define PARTICLE_CHUNK (16)
+
+struct Particle particles[N_PARTICLES];
+u32 particle_head = 0, particle_count = 0;
+
+/* Whether game events emit particles. Off while the bot plays ahead. */
+bool effects = false;
+
+/* State of the xorshift generator behind particle_rand(), separate from the
+ * game's so that effects never change what rand() returns */
+u32 particle_seed = 0x2545F491;
+
+/* Return a random number in [-range, range]. */
+s32 particle_rand(s32 range)
+{
+    particle_seed ^= particle_seed << 13;
+    particle_seed ^= particle_seed >> 17;
+    particle_seed ^= particle_seed << 5;
+    return (s32) (particle_seed % (u32) (2 * range + 1)) - range;
+}
+
+/* Emit n particles of kind from the middle of the piece at screen column x of
+ * row y, heading dx columns per update on average. */
+void emit(s8 x, s8 y, u32 n, enum particle_kind kind, s32 dx)
+{
+    s32 v = particle_kinds[kind].speed;
+    struct Particle *p;
+
+    if (!effects)
+        return;
+    while (n--) {
+        p = &particles[particle_head++ & PARTICLE_MASK];
+        p->x = ((x + 1) << FIX_SHIFT) + particle_rand(FIX_ONE / 2);
+        p->y = (y << FIX_SHIFT) + FIX_ONE / 2;
+        p->vx = dx + particle_rand(v);
+        p->vy = particle_rand(v / 2);
+        p->ay = particle_kinds[kind].gravity;
+        p->max = particle_kinds[kind].life;
+        p->life = p->max * 3 / 4 + particle_rand(p->max / 4);
+        p->kind = kind;
+        if (particle_count < N_PARTICLES)
+            particle_count++;
+    }
+}
+
+/* Move every live particle by a step and age it, newest first. Return true if
+ * any were live, so need redrawing. */
+bool particles_update(void)
+{
+    u64 deadline = rdtsc() + tuning.particle_budget;
+    u32 n, k, end, was = particle_count;
+    struct Particle *p;
+
+    for (n = 0; n < particle_count; n = end) {
+        if (rdtsc() > deadline) {
+            particle_count = n;
+            break;
+        }
+        end = n + PARTICLE_CHUNK < particle_count ? n + PARTICLE_CHUNK : particle_count;
+        for (k = n; k < end; k++) {
+            p = &particles[(particle_head - 1 - k) & PARTICLE_MASK];
+            p->x += p->vx;
+            p->y += p->vy;
+            p->vy += p->ay;
+            p->life -= p->life != 0;
+        }
+    }
+    while (particle_count
+           && !particles[(particle_head - particle_count) & PARTICLE_MASK].life)
+        particle_count--;
+    return was != 0;
+}
+
+/* Draw the live particles inside the well, newest first. */
+void particles_draw(void)
+{
+    u64 deadline = rdtsc() + tuning.particle_budget;
+    u32 n, k, end, f;
+    s32 x, y;
+    const struct Particle *p;
+
+    for (n = 0; n < particle_count; n = end) {
+        if (rdtsc() > deadline) {
+            particle_count = n;
+            break;
+        }
+        end = n + PARTICLE_CHUNK < particle_count ? n + PARTICLE_CHUNK : particle_count;
+        for (k = n; k < end; k++) {
+            p = &particles[(particle_head - 1 - k) & PARTICLE_MASK];
+            x = p->x >> FIX_SHIFT;
+            y = p->y >> FIX_SHIFT;
+            if (!p->life || x < WELL_X || x >= WELL_X + WELL_WIDTH * 2
+                    || y < 2 || y >= WELL_HEIGHT)
+                continue;
+            f = (p->life - 1) * 3 / p->max;
+            putc(x, y, particle_kinds[p->kind].fg[f], BLACK,
+                 particle_kinds[p->kind].c[f]);
+        }
+    }
+}
+
+// Initialize next level 
+void next_level(u32 l) {
+    
+    level = l;
+
+    // Initialize level settings 
+        switch(l) {
+        case 1:
+            enemyspawn = tuning.enemyspawn; 
+            enemymove = tuning.enemymove;  
+            wallmove = tuning.wallmove;   
+            corridor_w = WELL_WIDTH/2 - 1;
+            break;
+        case 2:
+            enemyspawn = tuning.enemyspawn * 2; 
+            enemymove = tuning.enemymove;  
+            wallmove = tuning.wallmove; 
+            corridor_w = WELL_WIDTH/2 - WELL_WIDTH/8 - 1;
+            break;
+        case 3:
+            enemyspawn = tuning.enemyspawn * 1.5; 
+            enemymove = tuning.enemymove;  
+            wallmove = tuning.wallmove; 
+            corridor_w = WELL_WIDTH/2 - WELL_WIDTH/8 - 1;
+            break;
+        case 4:
+            enemyspawn = tuning.enemyspawn * 1.5; 
+            enemymove = tuning.enemymove * 2;  
+            wallmove = enemymove; 
+            corridor_w = WELL_WIDTH/4 - 1;
+            break;
+        }
+        if (effects)
+            trace(TRACE_LEVEL, 0, l);
+        cont_enemyspawn = enemyspawn; 
+        cont_tick = tuning.tick - 1;
+        enemy_vy = FIX_VELOCITY(enemymove);
+        well_vy = FIX_VELOCITY(wallmove);
+        well_fy = 0;
+
+    // Start a straight corridor down the middle of an empty well
+        memset(well, 0, sizeof(well));
+        memset(flow, FLOW_DEPTH, sizeof(flow));
+        well_top = 0;
+        corridor_x = (WELL_WIDTH - corridor_w) / 2;
+        corridor_dir = 0;
+        corridor_run = 0;
+    
+    // Initialize pieces
+    //Enemies
+    u32 i;
+        switch(l) {
+        case 1:
+            for (i = 0; i < N_ENEMYS; i++) {
+                enemy[i].i = 1;
+                enemy[i].hp = 3;
+                enemy[i].dmg = 1;     
+                enemy[i].alive = false; 
+                enemy[i].x = 0;   
+                enemy[i].y = 0; 
+                enemy[i].fx = enemy[i].fy = 0;
+                enemy[i].vx = enemy[i].vy = 0;
+            }
+            break;
+        case 2:
+            for (i = 0; i < N_ENEMYS; i++) {
+                enemy[i].i = 2;
+                enemy[i].hp = 999;
+                enemy[i].dmg = 1;     
+                enemy[i].alive = false; 
+                enemy[i].x = 0;   
+                enemy[i].y = 0; 
+                enemy[i].fx = enemy[i].fy = 0;
+                enemy[i].vx = enemy[i].vy = 0;
+            }
+            break;
+        case 3:
+            for (i = 0; i < N_ENEMYS; i++) {
+                enemy[i].i = 3;
+                enemy[i].hp = 3;
+                enemy[i].dmg = 1;     
+                enemy[i].alive = false; 
+                enemy[i].x = 0;   
+                enemy[i].y = 0; 
+                enemy[i].fx = enemy[i].fy = 0;
+                enemy[i].vx = enemy[i].vy = 0;
+            }
+            break;
+        case 4:
+            for (i = 0; i < N_ENEMYS; i++) {
+                enemy[i].i = 4;
+                enemy[i].hp = 999;
+                enemy[i].dmg = 1;     
+                enemy[i].alive = false; 
+                enemy[i].x = 0;   
+                enemy[i].y = 0; 
+                enemy[i].fx = enemy[i].fy = 0;
+                enemy[i].vx = enemy[i].vy = 0;
+            }
+            break;  
+        }
+
+    //Player Laser
+            for (i = 0; i < N_LASERS; i++) {
+                laser[i].i = 1;
+                laser[i].hp = 999;
+                laser[i].dmg = 1;     
+                laser[i].alive = false; 
+                laser[i].x = 0;   
+                laser[i].y = 0; 
+                laser[i].fx = laser[i].fy = 0;
+                laser[i].vx = laser[i].vy = 0;
+            }
+
+    //Player
+             player.i = 1;
+             player.hp = 1;
+             player.dmg = 0;     
+             player.alive = false; 
+             player.x = WELL_WIDTH + 1;   
+             player.y = WELL_HEIGHT - 1; 
+             player.fx = player.fy = 0;
+             player.vx = player.vy = 0;
+}
+
+/* Generate the next row of the corridor into row: open cells from corridor_x
+ * for corridor_w cells, and walls of the current level everywhere else. From
+ * level 2 on, the corridor drifts one cell every other row, in runs of up to
+ * CORRIDOR_RUN rows to the left, to the right or straight on, turning back
+ * when it reaches the side of the well. */
+void corridor_row(u8 *row)
+{
+    u8 x;
+
+    if (level > 1) {
+        if (!corridor_run) {
+            corridor_run = rand(tuning.corridor_run) + 1;
+            corridor_dir = (s8) rand(3) - 1;
+        }
+        corridor_run--;
+        if (corridor_run & 1) {
+            if (corridor_x + corridor_dir < 1
+                    || corridor_x + corridor_w + corridor_dir > WELL_WIDTH - 1)
+                corridor_dir = -corridor_dir;
+            corridor_x += corridor_dir;
+        }
+    }
+    for (x = 0; x < WELL_WIDTH; x++)
+        row[x] = x < corridor_x || x >= corridor_x + corridor_w ? level : 0;
+}
+
+/* Bring flow up to date with a new top row. Only the top row and, below each
+ * of its walls, the cells whose distance it shortens are rewritten: a column
+ * stops at the first cell that keeps its value, as those below depend only on
+ * it. */
+void flow_row(void)
+{
+    u8 x, y, d;
+
+    for (x = 0; x < WELL_WIDTH; x++) {
+        d = FLOW_DEPTH;
+        for (y = 0; y < WELL_HEIGHT; y++) {
+            d = WELL_ROW(y)[x] ? 0 : d < FLOW_DEPTH ? d + 1 : FLOW_DEPTH;
+            if (y && FLOW_ROW(y)[x] == d)
+                break;
+            FLOW_ROW(y)[x] = d;
+        }
+    }
+}
+
+/* Return true if a piece at screen column x of row y of the well, which covers
+ * columns x and x + 1, overlaps a wall or the sides of the well. */
+bool terrain_hit(s8 x, s8 y)
+{
+    if (x < WELL_X || x + 1 >= WELL_X + WELL_WIDTH * 2)
+        return true;
+    return WELL_ROW(y)[(x - WELL_X) / 2] || WELL_ROW(y)[(x + 1 - WELL_X) / 2];
+}
+
+/* Return the rows a piece at screen column x of a row, whose flow is row, has
+ * before a wall comes down on it: 0 if it is in a wall already. */
+u8 clearance(const u8 *row, s8 x)
+{
+    u8 a, b;
+    if (x < WELL_X || x + 1 >= WELL_X + WELL_WIDTH * 2)
+        return 0;
+    a = row[(x - WELL_X) / 2];
+    b = row[(x + 1 - WELL_X) / 2];
+    return a < b ? a : b;
+}
+
+/* Set enemy i drifting one column sideways per row it falls toward the player,
+ * or straight down once in line, unless staying or turning away keeps it clear
+ * of walls for longer. */
+void steer_enemy(u32 i)
+{
+    s8 x = enemy[i].x, d, best = 0;
+    s8 order[3];
+    u8 k, c, most = 0;
+    const u8 *row;
+
+    if (enemy[i].alive == false)
+        return;
+    row = FLOW_ROW(enemy[i].y);
+    order[0] = player.x < x ? -1 : player.x > x;
+    order[1] = order[0] ? 0 : -1;
+    order[2] = order[0] ? -order[0] : 1;
+    for (k = 0; k < 3; k++) {
+        d = order[k];
+        c = clearance(row, x + d);
+        if (c > most) {
+            most = c;
+            best = d;
+        }
+    }
+    enemy[i].vx = best * enemy[i].vy;
+}
+
+/* If enemy i has run into a wall, push it back to the nearest open position on
+ * its row, trying one column to the right, then one to the left, and so on. */
+void push_enemy(u32 i)
+{
+    s8 d;
+    if (enemy[i].alive == false)
+        return;
+    for (d = 1; d < WELL_WIDTH * 2 && terrain_hit(enemy[i].x, enemy[i].y); d++)
+        enemy[i].x += d & 1 ? d : -d;
+}
+
+/* Add the velocity of p to its position, and return true if that took it into
+ * another cell. */
+bool advance_piece(struct Piece *p)
+{
+    s32 fx = p->fx + p->vx, fy = p->fy + p->vy;
+    p->fx = fx & FIX_MASK;
+    p->fy = fy & FIX_MASK;
+    fx >>= FIX_SHIFT;
+    fy >>= FIX_SHIFT;
+    p->x += fx;
+    p->y += fy;
+    return fx || fy;
+}
+
+/* Increase the score by value, and change to next level.
+ */
+void increase_score(u32 value)
+{
+  score += value;
+  u32 points = tuning.score_level;
+  if (score >= points && score < 2 * points && level < 2) {
+     next_level(2);
+  }
+  if (score >= 2 * points && score < 3 * points && level < 3) {
+     next_level(3);
+  }
+  if (score >= 3 * points && level < 4) {
+     next_level(4);
+  }
+} 
+
+/* End the game with the player blowing up. */
+void crash(void)
+{
+    if (!game_over) {
+        emit(player.x, WELL_HEIGHT - 1, 24, PARTICLE_SPARK, 0);
+        emit(player.x, WELL_HEIGHT - 1, 12, PARTICLE_DEBRIS, 0);
+    }
+    game_over = true;
+}
+
+/* Try to move the player by dx and return true if successful.
+ */
+bool move(s8 dx)
+{
+    if (game_over)
+        return false;
+
+    if(!paused){
+        if(dx < 0 && 2 < player.x){
+    	    player.x += dx;
+    	    latency_input();
+    	    emit(player.x, WELL_HEIGHT - 1, 2, PARTICLE_TRAIL, -dx * FIX_ONE);
+        }
+        if(dx > 0 && player.x < WELL_WIDTH*2){
+    	    player.x += dx;
+    	    latency_input();
+    	    emit(player.x, WELL_HEIGHT - 1, 2, PARTICLE_TRAIL, -dx * FIX_ONE);
+        }
+        if (terrain_hit(player.x, WELL_HEIGHT - 1)) {
+            crash(); // GAME OVER
+        }
+    }
+    return true;
+}
+
+/* Return true if move_playerlasers() has any laser to move. */
+bool lasers_flying(void)
+{
+    u32 i;
+    for (i = 0; i < N_LASERS; i++)
+        if (laser[i].alive == true && laser[i].y > 1)
+            return true;
+    return false;
+}
+
+/* Try to move the player's lasers by their velocity and return true if
+ * successful.
+ */
+bool move_playerlasers()
+{
+    u32 i, j;
+
+    if (game_over)
+       return false;
+
+    if(!paused){
+       for (i = 0; i < N_LASERS; i++) {
+         if (laser[i].alive == true && laser[i].y > 1) { // Move lasers if they'are alive
+           if (!advance_piece(&laser[i]))
+             continue;
+           if (laser[i].y <= 1) { // Laser is not alive anymore
+             laser[i].alive = false;
+           }
+
+           for (j = 0; j < N_ENEMYS; j++) { // If enemys collide with lasers
+             if (enemy[j].alive == true) { // If enemy is alive
+               if (laser[i].y == enemy[j].y && ((laser[i].x == enemy[j].x) || (laser[i].x == enemy[j].x + 1) || (laser[i].x + 1 == enemy[j].x))) {
+                 enemy[j].hp += -laser[i].dmg;
+                 laser[i].alive = false; // Laser is not alive anymore 
+                 if (enemy[j].hp <= 0) {
+                   emit(enemy[j].x, enemy[j].y, 12, PARTICLE_SPARK, 0);
+                   emit(enemy[j].x, enemy[j].y, 4, PARTICLE_DEBRIS, 0);
+                   increase_score(tuning.score_kill);
+                   enemy[j].alive = false; // Enemy is not alive anymore                   
+                 } else emit(enemy[j].x, enemy[j].y, 3, PARTICLE_SPARK, 0);
+               }
+             }
+           } 
+         }        
+       }
+    }
+    return true;    
+}
+
+/* Move the enemys by their velocity, handling those that changed cell, and
+ * return true if any did.
+ */
+bool move_enemys()
+{
+    u32 i;
+    bool moved = false;
+
+    if (game_over)
+       return false;
+
+    if(!paused){
+       for (i = 0; i < N_ENEMYS; i++) {
+         if (enemy[i].alive == true && enemy[i].y < WELL_HEIGHT) { // Move enemys if they'are alive
+           if (!advance_piece(&enemy[i]))
+             continue;
+           moved = true;
+           if (enemy[i].y >= WELL_HEIGHT) { // Enemy is not alive anymore
+             enemy[i].alive = false;
+             switch(level) { // Increase score if level 2 or 4
+             case 2:
+             increase_score(tuning.score_dodge);
+             break;
+             case 4:
+             increase_score(tuning.score_dodge);
+             break;  
+             }
+           }
+           push_enemy(i); // If enemy moved into a wall
+           steer_enemy(i);
+           // If player collides with enemy
+           if (enemy[i].y == WELL_HEIGHT - 1) {
+             if ((enemy[i].x == player.x) || (enemy[i].x == player.x + 1) || (enemy[i].x + 1 == player.x)) {
+               crash(); // GAME OVER    
+             }
+           }   
+         }        
+       }
+    }
+    return moved;    
+}
+
+/* Try to scroll the well down by 1 row, generating the next row of the
+ * corridor at the top, and return true if successful. Only the new row is
+ * written.
+ */
+bool move_walls()
+{
+    u32 i;
+
+    if (game_over)
+       return false;
+
+    if(!paused){
+       well_top = (well_top + WELL_HEIGHT - 1) % WELL_HEIGHT;
+       corridor_row(well[well_top]);
+       flow_row();
+
+       for (i = 0; i < N_ENEMYS; i++) // If walls moved into enemys
+         push_enemy(i);
+
+       // If player collides with walls
+       if (terrain_hit(player.x, WELL_HEIGHT - 1)) {
+         crash(); // GAME OVER
+       }
+    }
+    return true;    
+}
+
+/* Spawns a player's laser.
+ */
+void spawn_playerlaser() 
+{
+   u32 i;
+   if (!game_over && !paused) {
+
+   for (i = 0; i < tuning.lasers; i++) {
+     if (laser[i].alive == false) { // Search for lasers that aren't alive
+       laser[i].alive = true;
+       laser[i].x = player.x;
+       laser[i].y = WELL_HEIGHT - 2;
+       laser[i].fx = laser[i].fy = 0;
+       laser[i].vx = 0;
+       laser[i].vy = LASER_VY;
+       latency_input();
+       break;
+     }        
+   }
+   
+   }
+}
+
+/* Spawns an enemy, somewhere inside the corridor.
+ */
+void spawn_enemy(void) 
+{
+   u32 i;
+   u32 r = 0; // Random column
+
+   if (!game_over && !paused) {
+
+   r = rand(corridor_w * 2 - 1) + WELL_X + corridor_x * 2;
+   
+   for (i = 0; i < tuning.enemys; i++) {
+     if (enemy[i].alive == false) { // Search for enemys that aren't alive
+       enemy[i].alive = true;
+       enemy[i].x = r;
+       enemy[i].y = 2;
+       enemy[i].fx = enemy[i].fy = 0;
+       enemy[i].vx = 0;
+       enemy[i].vy = enemy_vy;
+       switch(level) { // Select the range between walls for level
+       case 1:
+           enemy[i].hp = 2;
+           enemy[i].dmg = 1;  
+           break;
+       case 2:
+           enemy[i].hp = 999;
+           enemy[i].dmg = 1;    
+           break;
+       case 3:
+           enemy[i].hp = 2;
+           enemy[i].dmg = 1;  
+           break;
+       case 4:
+           enemy[i].hp = 999;
+           enemy[i].dmg = 1; 
+           break;  
+       }
+       push_enemy(i); // The corridor may have drifted since the top row
+       steer_enemy(i);
+       break;
+     }        
+   }
+
+   }
+}
+
+/* Advance the well and the enemys by one tick of their velocities, scrolling
+ * the well and handling the enemys that changed cell. Return true if anything
+ * moved. */
+bool advance(void)
+{
+    bool moved = false;
+
+    if (game_over || paused)
+        return false;
+    for (well_fy += well_vy; well_fy >= FIX_ONE; well_fy -= FIX_ONE) {
+        move_walls();
+        moved = true;
+    }
+    return move_enemys() || moved;
+}
+
+/* Update the game state. Called at an interval relative to the current level.
+ */
+void update(void)
+{
+    move_playerlasers();
+}
+
+/* Advance the spawn and tick counters by one iteration of the main loop,
+ * spawning an enemy and advancing everything by a tick when their counters
+ * reach zero. Return true if anything was spawned or moved. */
+bool step(void)
+{
+    bool updated = false;
+    if (cont_enemyspawn > 0) { // Spawns an enemy once counter reaches zero
+      cont_enemyspawn += -1;
+    } else {
+      cont_enemyspawn = enemyspawn;
+      spawn_enemy();
+      updated = true;
+    }
+    if (cont_tick > 0) { // Advances everything once counter reaches zero
+      cont_tick += -1;
+    } else {
+      cont_tick = tuning.tick - 1;
+      if (advance())
+        updated = true;
+    }
+    return updated;
+}
+
+/* Replays
+ *
+ * A replay is the seed and level a game started from and every input that
+ * changed it since, as events in the order the main loop applied them: each
+ * is a number of step()s to run, then one thing to do. Run through again by
+ * the same build, they play the game out the same way. The number of events
+ * recorded is part of struct State, so rewinding drops those after the point
+ * it goes back to. update()s with no laser in flight change nothing and are
+ * left out, their steps carried over to the next event. */
+
+enum replay_event {
+    REPLAY_STEPS,  /* Only the steps */
+    REPLAY_LEFT,   /* move(-1) */
+    REPLAY_RIGHT,  /* move(1) */
+    REPLAY_FIRE,   /* spawn_playerlaser() */
+    REPLAY_UPDATE, /* update() */
+    REPLAY_PAUSE   /* paused = !paused */
+};
+
+/* Each event is packed into a u32, the steps below REPLAY_SHIFT and the
+ * enum replay_event above. */
+#define REPLAY_SHIFT     (29)
+#define REPLAY_MAX_STEPS ((1 << REPLAY_SHIFT) - 1)
+
+/* "LDR2" */
+#define REPLAY_MAGIC (0x3252444C)
+
+/* truncated is set if events were dropped for lack of room, in which case the
+ * replay stops short of the score, and tuned if the console changed a setting
+ * during the game, or one from config.h before it, in which case the replay
+ * need not play out the same. */
+struct ReplayHeader {
+    u32 magic, seed, level, score, events, truncated, tuned;
+};
+
+#define REPLAY_EVENTS \
+    ((REPLAY_SECTORS * SECTOR - sizeof(struct ReplayHeader)) / sizeof(u32))
+
+/* The replay being recorded, laid out as it is written to disk. Events past
+ * REPLAY_EVENTS are dropped, though still counted in replay_n. */
+struct {
+    struct ReplayHeader header;
+    u32 events[REPLAY_EVENTS];
+} replay;
+
+/* Events recorded, dropped ones included, and steps run since the last one */
+u32 replay_n = 0, replay_steps = 0;
+
+/* Whether the game being recorded has been through the high scores. It stays
+ * set if the game is rewound out of game over, so that dying again does not
+ * enter the same game twice. */
+bool replay_scored = false;
+
+/* Start recording a game started from seed s at level l. */
+void replay_start(u32 s, u32 l)
+{
+    replay.header.magic = REPLAY_MAGIC;
+    replay.header.seed = s;
+    replay.header.level = l;
+    replay.header.tuned = retuned;
+    replay_n = 0;
+    replay_steps = 0;
+    replay_scored = false;
+}
+
+/* Record event e, after the steps run since the last one. */
+void replay_record(enum replay_event e)
+{
+    if (replay_n < REPLAY_EVENTS)
+        replay.events[replay_n] = (u32) e << REPLAY_SHIFT | replay_steps;
+    replay_n++;
+    replay_steps = 0;
+}
+
+/* Record that step() has run. */
+void replay_step(void)
+{
+    if (++replay_steps == REPLAY_MAX_STEPS)
+        replay_record(REPLAY_STEPS);
+}
+
+/* Apply event e, as the main loop did when it was recorded, after its steps
+ * have been run. */
+void replay_apply(enum replay_event e)
+{
+    switch (e) {
+    case REPLAY_STEPS:
+        break;
+    case REPLAY_LEFT:
+        move(-1);
+        break;
+    case REPLAY_RIGHT:
+        move(1);
+        break;
+    case REPLAY_FIRE:
+        spawn_playerlaser();
+        break;
+    case REPLAY_UPDATE:
+        update();
+        break;
+    case REPLAY_PAUSE:
+        paused = !paused;
+        break;
+    }
+}
+
+/* Rewind */
+
+/* Everything that changes during play, as captured into the rewind buffer.
+ * The UI state (paused, debug, help) is deliberately left out. */
+struct State {
+    struct Piece enemy[N_ENEMYS];
+    struct Piece laser[N_LASERS];
+    struct Piece player;
+    u32 score, level, speed;
+    bool game_over;
+    u32 wallmove, enemyspawn, enemymove;
+    u32 cont_enemyspawn, cont_tick;
+    s32 enemy_vy, well_vy;
+    u32 well_fy;
+    u8 well[WELL_HEIGHT][WELL_WIDTH];
+    u8 flow[WELL_HEIGHT][WELL_WIDTH];
+    u8 well_top, corridor_x, corridor_w;
+    s8 corridor_dir;
+    u8 corridor_run;
+    u32 seed;
+    u32 replay_n, replay_steps;
+};
+
+/* Copy the current game state into s. */
+void save_state(struct State *s)
+{
+    memcpy(s->enemy, enemy, sizeof(enemy));
+    memcpy(s->laser, laser, sizeof(laser));
+    s->player = player;
+    s->score = score;
+    s->level = level;
+    s->speed = speed;
+    s->game_over = game_over;
+    s->wallmove = wallmove;
+    s->enemyspawn = enemyspawn;
+    s->enemymove = enemymove;
+    s->cont_enemyspawn = cont_enemyspawn;
+    s->cont_tick = cont_tick;
+    s->enemy_vy = enemy_vy;
+    s->well_vy = well_vy;
+    s->well_fy = well_fy;
+    memcpy(s->well, well, sizeof(well));
+    memcpy(s->flow, flow, sizeof(flow));
+    s->well_top = well_top;
+    s->corridor_x = corridor_x;
+    s->corridor_w = corridor_w;
+    s->corridor_dir = corridor_dir;
+    s->corridor_run = corridor_run;
+    s->seed = seed;
+    s->replay_n = replay_n;
+    s->replay_steps = replay_steps;
+}
+
+/* Replace the current game state with s. */
+void load_state(const struct State *s)
+{
+    memcpy(enemy, s->enemy, sizeof(enemy));
+    memcpy(laser, s->laser, sizeof(laser));
+    player = s->player;
+    score = s->score;
+    level = s->level;
+    speed = s->speed;
+    game_over = s->game_over;
+    wallmove = s->wallmove;
+    enemyspawn = s->enemyspawn;
+    enemymove = s->enemymove;
+    cont_enemyspawn = s->cont_enemyspawn;
+    cont_tick = s->cont_tick;
+    enemy_vy = s->enemy_vy;
+    well_vy = s->well_vy;
+    well_fy = s->well_fy;
+    memcpy(well, s->well, sizeof(well));
+    memcpy(flow, s->flow, sizeof(flow));
+    well_top = s->well_top;
+    corridor_x = s->corridor_x;
+    corridor_w = s->corridor_w;
+    corridor_dir = s->corridor_dir;
+    corridor_run = s->corridor_run;
+    seed = s->seed;
+    replay_n = s->replay_n;
+    replay_steps = s->replay_steps;
+}
+
+/* Encode the difference between states a and b as runs of (unchanged count,
+ * changed count, changed bytes XOR'd) into out, which must have room for n
+ * bytes. Return the encoded length, or n if the delta would not be smaller than
+ * a full copy. */
+u32 delta_encode(const u8 *a, const u8 *b, u32 n, u8 *out)
+{
+    u32 i = 0, o = 0, skip, run;
+    while (i < n) {
+        for (skip = 0; i < n && skip < 255 && a[i] == b[i]; i++, skip++);
+        if (i == n)
+            break;
+        for (run = 0; i + run < n && run < 255 && a[i + run] != b[i + run]; run++);
+        if (o + 2 + run >= n)
+            return n;
+        out[o++] = skip;
+        out[o++] = run;
+        for (; run; run--, i++)
+            out[o++] = a[i] ^ b[i];
+    }
+    return o;
+}
+
+/* Apply a delta of length len produced by delta_encode to a in-place. */
+void delta_decode(u8 *a, const u8 *d, u32 len)
+{
+    u32 i = 0, o = 0, run;
+    while (o < len) {
+        i += d[o++];
+        for (run = d[o++]; run; run--)
+            a[i++] ^= d[o++];
+    }
+}
+
+/* A captured frame, as a full copy of the state (key) or a delta from the
+ * previous frame, stored at off in rewind_data. */
+struct Frame {
+    u32 off;
+    u16 len;
+    u8 key;
+};
+
+/* Both the frame index and the frame data come out of REWIND_BUDGET. */
+#define REWIND_FRAMES (REWIND_BUDGET / 64)
+#define REWIND_DATA   (REWIND_BUDGET - REWIND_FRAMES * sizeof(struct Frame))
+
+struct Frame rewind_frames[REWIND_FRAMES];
+u8 rewind_data[REWIND_DATA];
+
+/* Frame numbers count up from boot and are mapped onto rewind_frames modulo
+ * REWIND_FRAMES. rewind_first is always a key frame. */
+u32 rewind_first = 0, rewind_count = 0, rewind_key = 0, rewind_cursor = 0;
+u32 rewind_head = 0;
+
+/* The state of the newest frame (or the frame at the cursor while rewinding),
+ * which the next delta is encoded against, and scratch space for encoding. */
+struct State rewind_prev, rewind_cur;
+u8 rewind_delta[sizeof(struct State)];
+
+bool rewinding = false;
+
+#define FRAME(n) (rewind_frames[(n) % REWIND_FRAMES])
+
+/* Drop the oldest frame and any deltas that depended on it. */
+void rewind_evict(void)
+{
+    do {
+        rewind_first++;
+        rewind_count--;
+    } while (rewind_count && !FRAME(rewind_first).key);
+    if (!rewind_count)
+        rewind_head = 0;
+}
+
+/* Reserve len contiguous bytes of rewind_data after the newest frame, evicting
+ * the oldest frames until they fit, and return their offset. */
+u32 rewind_alloc(u32 len)
+{
+    u32 tail;
+    while (rewind_count) {
+        tail = FRAME(rewind_first).off;
+        if (rewind_head > tail) {
+            if (rewind_head + len <= REWIND_DATA)
+                return rewind_head;
+            if (len <= tail)
+                return rewind_head = 0;
+        } else if (rewind_head + len <= tail)
+            return rewind_head;
+        rewind_evict();
+    }
+    return rewind_head = 0;
+}
+
+/* Capture the current state as the newest frame, as a key frame every
+ * REWIND_KEYFRAME frames and as a delta from the previous frame otherwise. */
+void rewind_capture(void)
+{
+    u32 n = rewind_first + rewind_count, len = sizeof(struct State), off;
+    const u8 *src = (const u8 *) &rewind_cur;
+    bool key = !rewind_count || n - rewind_key >= REWIND_KEYFRAME;
+
+    save_state(&rewind_cur);
+    if (!key) {
+        len = delta_encode((const u8 *) &rewind_prev, (const u8 *) &rewind_cur,
+                           sizeof(struct State), rewind_delta);
+        if (len < sizeof(struct State))
+            src = rewind_delta;
+        else key = true;
+    }
+    if (rewind_count == REWIND_FRAMES)
+        rewind_evict();
+    off = rewind_alloc(len);
+    if (!rewind_count && !key) { /* The delta's base frames were evicted */
+        key = true;
+        len = sizeof(struct State);
+        src = (const u8 *) &rewind_cur;
+        off = rewind_alloc(len);
+    }
+    if (!rewind_count)
+        rewind_first = n;
+
+    memcpy(rewind_data + off, src, len);
+    rewind_head = off + len;
+    FRAME(n).off = off;
+    FRAME(n).len = len;
+    FRAME(n).key = key;
+    if (key)
+        rewind_key = n;
+    rewind_count++;
+    memcpy(&rewind_prev, &rewind_cur, sizeof(struct State));
+}
+
+/* Decode frame n into rewind_prev and make it the current game state. At most
+ * REWIND_KEYFRAME - 1 deltas are applied on top of the nearest key frame. */
+void rewind_seek(u32 n)
+{
+    u32 k;
+    for (rewind_key = n; !FRAME(rewind_key).key; rewind_key--);
+    memcpy(&rewind_prev, rewind_data + FRAME(rewind_key).off,
+           sizeof(struct State));
+    for (k = rewind_key + 1; k <= n; k++)
+        delta_decode((u8 *) &rewind_prev, rewind_data + FRAME(k).off,
+                     FRAME(k).len);
+    load_state(&rewind_prev);
+}
+
+/* Start rewinding from the newest frame. */
+void rewind_start(void)
+{
+    if (!rewind_count)
+        return;
+    rewinding = true;
+    rewind_cursor = rewind_first + rewind_count - 1;
+    rewind_seek(rewind_cursor);
+}
+
+/* Step one frame further back, stopping at the oldest frame. */
+void rewind_step(void)
+{
+    if (rewind_cursor > rewind_first)
+        rewind_seek(--rewind_cursor);
+}
+
+/* Stop rewinding and resume play from the cursor, discarding newer frames. */
+void rewind_stop(void)
+{
+    rewinding = false;
+    rewind_count = rewind_cursor - rewind_first + 1;
+    rewind_head = FRAME(rewind_cursor).off + FRAME(rewind_cursor).len;
+}
+
+/* Restart
+ *
+ * After game over, a new game starts in place rather than through a reboot,
+ * which would run the BIOS, the boot loader and the timing calibration again.
+ * All of struct State is put back in one go from fresh, the state saved before
+ * the first game, and what lives outside it (the timers, particles and rewind
+ * frames) is cleared with it. tpms, the settings and the high scores are
+ * kept. */
+
+struct State fresh;
+
+/* Start a new game at level l. */
+void restart(u32 l)
+{
+    load_state(&fresh);
+    memset(timers, 0, sizeof(timers));
+    particle_head = particle_count = 0;
+    rewind_count = rewind_head = 0;
+    rewinding = paused = false;
+    srand(rdtsc());
+    next_level(l);
+    replay_start(seed, level);
+}
+
+/* Autoplay */
+
+/* Moves the bot chooses between on each decision */
+enum action {
+    ACTION_STAY,
+    ACTION_LEFT,
+    ACTION_RIGHT,
+    ACTION_FIRE,
+    ACTION__LENGTH
+};
+
+bool autoplay = false;
+
+/* The real state, saved while candidate moves are simulated on the globals. */
+struct State bot_root;
+
+/* Apply action a to the current state. */
+void bot_act(enum action a)
+{
+    switch (a) {
+    case ACTION_LEFT:
+        move(-1);
+        break;
+    case ACTION_RIGHT:
+        move(1);
+        break;
+    case ACTION_FIRE:
+        spawn_playerlaser();
+        break;
+    case ACTION_STAY:
+    case ACTION__LENGTH:
+        break;
+    }
+}
+
+/* Advance the simulation by ticks up to the next one that moves the walls or
+ * an enemy, moving the player's lasers along with it. No enemys are spawned,
+ * and the rows the corridor generator adds at the top do not reach the player
+ * within the lookahead. */
+void bot_sim(void)
+{
+    u32 n;
+    cont_tick = tuning.tick - 1;
+    for (n = 0; n < FIX_ONE && !game_over && !advance(); n++)
+        ;
+    move_playerlasers();
+}
+
+/* Return the x the player should aim for: the middle of the open cells in the
+ * row just above the player. */
+s8 bot_centre(void)
+{
+    const u8 *row = WELL_ROW(WELL_HEIGHT - 2);
+    u8 x, lo = WELL_WIDTH, hi = 0;
+    for (x = 0; x < WELL_WIDTH; x++) {
+        if (row[x])
+            continue;
+        if (lo == WELL_WIDTH)
+            lo = x;
+        hi = x;
+    }
+    if (lo == WELL_WIDTH)
+        return player.x;
+    return WELL_X + lo + hi;
+}
+
+/* Score holding action a for the next BOT_DEPTH steps from the current state.
+ * Surviving longer dominates, then game score, then closeness to the middle of
+ * the corridor. Return -1 if the cycle budget ran out before the end. */
+s32 bot_eval(enum action a, u64 deadline)
+{
+    u32 d;
+    s32 off;
+    for (d = 0; d < BOT_DEPTH && !game_over; d++) {
+        if (rdtsc() > deadline)
+            return -1;
+        bot_act(a);
+        bot_sim();
+    }
+    off = player.x - bot_centre();
+    if (off < 0)
+        off = -off;
+    return d * 1000000 + score * 100 - off;
+}
+
+/* Pick the best action by simulating each from a clone of the current state,
+ * within BOT_BUDGET CPU ticks, and apply it. Actions not evaluated in time are
+ * not considered; if none were, the bot stays put. */
+void bot(void)
+{
+    u64 deadline = rdtsc() + tuning.bot_budget;
+    enum action a, best = ACTION_STAY;
+    s32 v, best_v = -1;
+
+    bool e = effects;
+
+    save_state(&bot_root);
+    effects = false;
+    for (a = 0; a < ACTION__LENGTH; a++) {
+        v = bot_eval(a, deadline);
+        load_state(&bot_root);
+        if (v < 0)
+            break;
+        if (v > best_v) {
+            best_v = v;
+            best = a;
+        }
+    }
+    effects = e;
+    bot_act(best);
+    if (best != ACTION_STAY)
+        replay_record(best == ACTION_LEFT ? REPLAY_LEFT
+                      : best == ACTION_RIGHT ? REPLAY_RIGHT : REPLAY_FIRE);
+}
+
+/* High scores
+ *
+ * Sector 0 of the disk holds the best N_HIGHSCORES games, best first, and the
+ * REPLAY_SECTORS sectors from 1 + slot * REPLAY_SECTORS hold the replay of
+ * the game in that slot. A game that makes the table takes the slot of the
+ * one it pushes out. Without a disk the table only lasts until reset. */
+
+/* "LDHI" */
+#define SCORES_MAGIC (0x4948444C)
+
+struct HighScore {
+    u32 score, level, slot;
+};
+
+struct {
+    u32 magic, count;
+    struct HighScore best[N_HIGHSCORES];
+} scores;
+
+/* Look for the disk and load the table from it. */
+void scores_load(void)
+{
+    u8 sector[SECTOR];
+
+    disk_init();
+    if (disk_sectors < 1 + N_HIGHSCORES * REPLAY_SECTORS) {
+        disk_sectors = 0;
+        serial_puts("disk: none, high scores will not be kept\n");
+        return;
+    }
+    serial_puts("disk: ");
+    serial_puts(itoa(disk_sectors, 10, 10));
+    serial_puts(" sectors\n");
+    if (!disk_read(0, sector))
+        return;
+    memcpy(&scores, sector, sizeof(scores));
+    if (scores.magic != SCORES_MAGIC || scores.count > N_HIGHSCORES)
+        memset(&scores, 0, sizeof(scores));
+}
+
+/* Enter the game just over into the table if it made it, and queue its
+ * replay and the table to be written. */
+void scores_game_over(void)
+{
+    u8 sector[SECTOR];
+    u32 i, slot, n;
+
+    if (scores.count == N_HIGHSCORES
+            && score <= scores.best[N_HIGHSCORES - 1].score)
+        return;
+    if (scores.count < N_HIGHSCORES)
+        slot = scores.count++;
+    else slot = scores.best[N_HIGHSCORES - 1].slot;
+    for (i = scores.count - 1; i > 0 && scores.best[i - 1].score < score; i--)
+        scores.best[i] = scores.best[i - 1];
+    scores.best[i].score = score;
+    scores.best[i].level = level;
+    scores.best[i].slot = slot;
+    scores.magic = SCORES_MAGIC;
+
+    serial_puts("high score ");
+    serial_puts(itoa(i + 1, 10, 1));
+    serial_puts(": ");
+    serial_puts(itoa(score, 10, 10));
+    serial_puts(disk_sectors ? ", saving replay\n" : "\n");
+
+    replay_record(REPLAY_STEPS); /* Up to the step that ended it */
+    replay.header.score = score;
+    replay.header.truncated = replay_n > REPLAY_EVENTS;
+    replay.header.events = replay.header.truncated ? REPLAY_EVENTS : replay_n;
+    n = (sizeof(replay.header) + replay.header.events * sizeof(u32) + SECTOR - 1)
+        / SECTOR;
+    for (i = 0; i < n; i++)
+        disk_write(1 + slot * REPLAY_SECTORS + i, (const u8 *) &replay + i * SECTOR);
+    memset(sector, 0, sizeof(sector));
+    memcpy(sector, &scores, sizeof(scores));
+    disk_write(0, sector);
+}
+
+/* Widgets
+ *
+ * Overlays are retained: a widget remembers the value it last showed and its
+ * formatted text, and widget_draw() only writes to the screen when the value
+ * has changed or the screen under the widget has been cleared or painted over
+ * since. Drawing a widget that is up to date costs a comparison.
+ *
+ * A widget has a fixed part, drawn by render or as label at lx, ly, and
+ * optionally a value, drawn at x, y as itoa(value, base, width). */
+struct widget {
+    void (*render)(void);
+    const char *label;
+    u8 lx, ly;
+    enum color lfg;
+    u8 x, y;
+    enum color fg;
+    u8 base, width;
+    u32 value;
+    char text[11];
+    u32 epoch;
+};
+
+/* Draw widget w showing value, if it is not already on screen. */
+void widget_draw(struct widget *w, u32 value)
+{
+    bool stale = w->epoch != screen_epoch;
+
+    if (stale) {
+        if (w->render)
+            w->render();
+        if (w->label)
+            puts(w->lx, w->ly, w->lfg, BLACK, w->label);
+    }
+    if (w->width && (stale || value != w->value || !w->text[0])) {
+        if (value != w->value || !w->text[0]) {
+            w->value = value;
+            memcpy(w->text, itoa(value, w->base, w->width), w->width + 1);
+        }
+        puts(w->x, w->y, w->fg, BLACK, w->text);
+    }
+    w->epoch = screen_epoch;
+}
+
+/* Make widget w redraw, after something else has been drawn over it. */
+void widget_invalidate(struct widget *w)
+{
+    w->epoch = 0;
+}
+
+/* Draw the key bindings on the left. */
+void draw_help(void)
+{
+    puts(1, 12, BRIGHT | BLUE, BLACK, "LEFT");
+    puts(7, 12, BLUE,          BLACK, "- Move left");
+    puts(1, 13, BRIGHT | BLUE, BLACK, "RIGHT");
+    puts(7, 13, BLUE,          BLACK, "- Move right");
+    puts(1, 14, BRIGHT | BLUE, BLACK, "SPACE BAR");
+    puts(7, 14, BLUE,          BLACK, "- Shoot");
+    puts(1, 15, BRIGHT | BLUE, BLACK, "R");
+    puts(7, 15, BLUE,          BLACK, "- Rewind (hold)");
+    puts(1, 16, BRIGHT | BLUE, BLACK, "A");
+    puts(7, 16, BLUE,          BLACK, "- Toggle autoplay");
+    puts(1, 17, BRIGHT | BLUE, BLACK, "P");
+    puts(7, 17, BLUE,          BLACK, "- Pause");
+    puts(1, 18, BRIGHT | BLUE, BLACK, "D");
+    puts(7, 18, BLUE,          BLACK, "- Toggle debug info");
+    puts(1, 19, BRIGHT | BLUE, BLACK, "H");
+    puts(7, 19, BLUE,          BLACK, "- Toggle help");
+    puts(1, 20, BRIGHT | BLUE, BLACK, "ENTER");
+    puts(7, 20, BLUE,          BLACK, "- Play again (game over)");
+    puts(1, 21, BRIGHT | BLUE, BLACK, "1-4");
+    puts(7, 21, BLUE,          BLACK, "- Play again at level");
+}
+
+struct widget help_widget = {.render = draw_help};
+
+/* Debug panel, one labelled value per row in the top left */
+enum debug_field {
+    DEBUG_RTC,
+    DEBUG_TPMS,
+    DEBUG_KEY,
+    DEBUG_P50,
+    DEBUG_P99,
+    DEBUG_MAX,
+    DEBUG_OVERRUNS,
+    DEBUG_TIMER,
+    DEBUG__LENGTH = DEBUG_TIMER + TIMER__LENGTH
+};
+
+#define DEBUG_WIDGET(row, name, b, w) \
+    {.label = name, .lx = 0, .ly = row, .lfg = BRIGHT | GREEN, \
+     .x = 10, .y = row, .fg = GREEN, .base = b, .width = w}
+
+struct widget debug_widgets[DEBUG__LENGTH] = {
+    DEBUG_WIDGET(0, "RTC sec:", 16, 2),
+    DEBUG_WIDGET(1, "ticks/ms:", 10, 10),
+    DEBUG_WIDGET(2, "key:", 16, 2),
+    DEBUG_WIDGET(3, "p50 (us):", 10, 10),
+    DEBUG_WIDGET(4, "p99 (us):", 10, 10),
+    DEBUG_WIDGET(5, "max (us):", 10, 10),
+    DEBUG_WIDGET(6, "overruns:", 10, 10),
+    DEBUG_WIDGET(7, "timer:", 10, 10),
+    DEBUG_WIDGET(8, "timer:", 10, 10),
+    DEBUG_WIDGET(9, "timer:", 10, 10),
+    DEBUG_WIDGET(10, "timer:", 10, 10),
+    DEBUG_WIDGET(11, "timer:", 10, 10),
+    DEBUG_WIDGET(12, "timer:", 10, 10)
+};
+
+/* Draw the debug panel for the last key event key. */
+void draw_debug(u8 key)
+{
+    u32 i;
+    widget_draw(&debug_widgets[DEBUG_RTC], rtc_sec);
+    widget_draw(&debug_widgets[DEBUG_TPMS], tpms);
+    widget_draw(&debug_widgets[DEBUG_KEY], key);
+    widget_draw(&debug_widgets[DEBUG_P50], latency_p50);
+    widget_draw(&debug_widgets[DEBUG_P99], latency_p99);
+    widget_draw(&debug_widgets[DEBUG_MAX], latency_max);
+    widget_draw(&debug_widgets[DEBUG_OVERRUNS], overruns);
+    for (i = 0; i < TIMER__LENGTH; i++)
+        widget_draw(&debug_widgets[DEBUG_TIMER + i], timers[i]);
+}
+
+#define TITLE_X (COLS / 2 - 9)
+#define TITLE_Y (ROWS / 2 - 1)
+
+/* Draw about information in the centre. Shown on boot and pause. */
+void draw_about(void) {
+    puts(TITLE_X,      TITLE_Y,     BLACK,            RED,     "   ");
+    puts(TITLE_X + 3,  TITLE_Y,     BLACK,            MAGENTA, "   ");
+    puts(TITLE_X + 6,  TITLE_Y,     BLACK,            BLUE,    "   ");
+    puts(TITLE_X + 9,  TITLE_Y,     BLACK,            GREEN,   "   ");
+/*    puts(TITLE_X + 12, TITLE_Y,     BLACK,            YELLOW,  "   ");
+    puts(TITLE_X + 15, TITLE_Y,     BLACK,            CYAN,    "   ");*/
+    puts(TITLE_X,      TITLE_Y + 1, BRIGHT | RED,     RED,     " L ");
+    puts(TITLE_X + 3,  TITLE_Y + 1, BRIGHT | MAGENTA, MAGENTA, " E ");
+    puts(TITLE_X + 6,  TITLE_Y + 1, BRIGHT | BLUE,    BLUE,    " A ");
+    puts(TITLE_X + 9,  TITLE_Y + 1, BRIGHT | GREEN,   GREEN,   " D ");
+/*    puts(TITLE_X + 12, TITLE_Y + 1, BRIGHT | YELLOW,  YELLOW,  "   ");
+    puts(TITLE_X + 15, TITLE_Y + 1, BRIGHT | CYAN,    CYAN,    "   ");*/
+    puts(TITLE_X,      TITLE_Y + 2, BLACK,            RED,     "   ");
+    puts(TITLE_X + 3,  TITLE_Y + 2, BLACK,            MAGENTA, "   ");
+    puts(TITLE_X + 6,  TITLE_Y + 2, BLACK,            BLUE,    "   ");
+    puts(TITLE_X + 9,  TITLE_Y + 2, BLACK,            GREEN,   "   ");
+/*    puts(TITLE_X + 12, TITLE_Y + 2, BLACK,            YELLOW,  "   ");
+    puts(TITLE_X + 15, TITLE_Y + 2, BLACK,            CYAN,    "   ");*/
+    
+    puts(4,  TITLE_Y + 8, BRIGHT | GRAY, BLACK, " Edgar Parra Barillas");
+    puts(4,  TITLE_Y + 7, BRIGHT | GRAY, BLACK, " Ricardo Viquez Mora");
+    puts(4,  TITLE_Y + 6, BRIGHT | GRAY, BLACK, " Jefri Cardenas Villatoro");
+
+    puts(4,  2, BRIGHT | GRAY, BLACK, "Principios de Sistemas Operativos");
+    puts(4,  1, BRIGHT | GRAY, BLACK, "Profesor: Ernesto Rivera Alvarado");
+    puts(0, ROWS - 1, BRIGHT | BLACK, BLACK,
+         LEAD_NAME " " LEAD_VERSION " " LEAD_URL);
+}
+
+#define STATUS_X (COLS * 3/4)
+#define STATUS_Y (ROWS / 2 - 4)
+
+#define SCORE_X STATUS_X
+#define SCORE_Y (ROWS / 2 - 1)
+
+#define LEVEL_X SCORE_X
+#define LEVEL_Y (SCORE_Y + 4)
+
+#define BEST_X SCORE_X
+#define BEST_Y (LEVEL_Y + 4)
+
+struct widget title_widget = {.render = draw_about};
+
+struct widget score_widget = {
+    .label = "SCORE", .lx = SCORE_X + 7, .ly = SCORE_Y, .lfg = BLUE,
+    .x = SCORE_X + 5, .y = SCORE_Y + 2, .fg = BRIGHT | BLUE,
+    .base = 10, .width = 10
+};
+
+struct widget level_widget = {
+    .label = "LEVEL", .lx = LEVEL_X + 7, .ly = LEVEL_Y, .lfg = BLUE,
+    .x = LEVEL_X + 5, .y = LEVEL_Y + 2, .fg = BRIGHT | BLUE,
+    .base = 10, .width = 10
+};
+
+struct widget best_widget = {
+    .label = "BEST", .lx = BEST_X + 7, .ly = BEST_Y, .lfg = BLUE,
+    .x = BEST_X + 5, .y = BEST_Y + 2, .fg = BRIGHT | BLUE,
+    .base = 10, .width = 10
+};
+
+/* Draw the well, current tetrimino, its ghost, the preview tetrimino, the
+ * status, score and level indicators. Each well/tetrimino cell is drawn one
+ * screen-row high and two screen-columns wide. The top two rows of the well
+ * are hidden. Rows in the cleared_rows array are drawn as white rather than
+ * their actual colors. */
+void draw(void)
+{
+    u8 x, y;
+    u32 i;
+
+    sprite_begin();
+    if (paused) {
+        widget_draw(&title_widget, 0);
+        goto status;
+    }
+
+    // The well covers the help and debug panels
+    widget_invalidate(&help_widget);
+    for (i = 0; i < DEBUG__LENGTH; i++)
+        widget_invalidate(&debug_widgets[i]);
+
+    // Border
+    for (y = 2; y < WELL_HEIGHT; y++) {
+        putc(WELL_X - 1,            y, BLACK, GRAY, ' ');
+       // putc(COLS / 2 + 2,          y, BLACK, GRAY, ' ');
+        putc(WELL_WIDTH*2 + 2,          y, BLACK, GRAY, ' ');
+    }
+    for (x = 0; x < WELL_WIDTH * 2 + 2; x++)
+        putc(WELL_X + x - 1, WELL_HEIGHT, BLACK, GRAY, ' ');
+
+    // Well 
+    for (y = 0; y < 2; y++)
+        for (x = 0; x < WELL_WIDTH; x++)
+            puts(WELL_X + x * 2, y, BLACK, BLACK, "  ");
+    for (y = 2; y < WELL_HEIGHT; y++)
+        for (x = 0; x < WELL_WIDTH; x++)
+            if (WELL_ROW(y)[x])
+                sprite(WELL_X + x * 2, y, SPRITE_WALL_1 + WELL_ROW(y)[x] - 1);
+            else
+                puts(WELL_X + x * 2, y, BRIGHT, BLACK, "::");
+
+    // Player
+    sprite(player.x, WELL_HEIGHT - 1, SPRITE_PLAYER);
+
+    // Enemys
+    for (i = 0; i < N_ENEMYS; i++) {
+      if (enemy[i].alive == true) { // Draws enemys if they'are alive
+        sprite(enemy[i].x, enemy[i].y, SPRITE_ENEMY_1 + level - 1);
+      }        
+    }
+
+    // Player Lasers
+    for (i = 0; i < N_LASERS; i++) {
+      if (laser[i].alive == true) { // Draws lasers if they'are alive
+        sprite(laser[i].x, laser[i].y, SPRITE_LASER);
+      }        
+    }
+
+    // Explosions, debris and trails
+    particles_draw();
+
+status:
+    if (paused)
+        puts(STATUS_X + 2, STATUS_Y, BRIGHT | YELLOW, BLACK, "PAUSED");
+    if (rewinding)
+        puts(STATUS_X + 2, STATUS_Y, BRIGHT | CYAN, BLACK, "REWIND");
+    if (autoplay)
+        puts(STATUS_X + 1, STATUS_Y + 1, GREEN, BLACK, "AUTOPLAY");
+    if (game_over) {
+        puts(STATUS_X, STATUS_Y, BRIGHT | RED, BLACK, "GAME OVER");
+        puts(STATUS_X, STATUS_Y + 2, RED, BLACK, "ENTER/1-4: AGAIN");
+    }
+
+    // Score 
+    widget_draw(&score_widget, score);
 
-    //Player
-             player.i = 1;
-             player.hp = 1;
-             player.dmg = 0;     
-             player.alive = false; 
-             player.x = WELL_WIDTH + 1;   
-             player.y = WELL_HEIGHT - 1; 
+    // Level 
+    widget_draw(&level_widget, level);
+
+    // Best score so far
+    widget_draw(&best_widget, scores.best[0].score);
 }
 
-/* Increase the score by value, and change to next level.
+/* Console
+ *
+ * A command line on COM1 for tuning the game while it runs. The COM1 IRQ only
+ * queues what arrives: console_poll(), called once a frame, echoes what has
+ * come in since and runs at most one complete line, so the loop is never held
+ * up by more than one command. Replies are queued for the IRQ to send.
+ *
+ *   get [name]      Show a setting, or all of them
+ *   set name value  Change a setting
+ *   level n         Jump to level n
+ *   pause           Pause or resume the game
+ *   stats           Show the counters
+ *   watch           Show the counters every second, or stop
  */
-void increase_score(u32 value)
+
+#define CONSOLE_LINE (64)
+
+struct tunable {
+    const char *name;
+    void *value;
+    u8 size; /* Of *value, 1 or 4 bytes */
+    u32 min, max;
+};
+
+/* In lower case, the current level's values, which next_level() sets again;
+ * in upper case, the settings from config.h it sets them from and the game
+ * plays by. */
+const struct tunable tunables[] = {
+    {"enemyspawn", &enemyspawn, 4, 1, 100000000},
+    {"enemymove", &enemymove, 4, 1000, 100000000},
+    {"wallmove", &wallmove, 4, 1000, 100000000},
+    {"corridor_w", &corridor_w, 1, 1, WELL_WIDTH - 2},
+    {"speed", &speed, 4, 1, 60000},
+    {"ENEMYSPAWN", &tuning.enemyspawn, 4, 1, 50000000},
+    {"ENEMYMOVE", &tuning.enemymove, 4, 1000, 50000000},
+    {"WALLMOVE", &tuning.wallmove, 4, 1000, 50000000},
+    {"TICK", &tuning.tick, 4, 1, 50000},
+    {"CORRIDOR_RUN", &tuning.corridor_run, 4, 1, 254},
+    {"SCORE_KILL", &tuning.score_kill, 4, 0, 1000},
+    {"SCORE_DODGE", &tuning.score_dodge, 4, 0, 1000},
+    {"SCORE_LEVEL", &tuning.score_level, 4, 1, 1000000},
+    {"N_ENEMYS", &tuning.enemys, 4, 0, N_ENEMYS},
+    {"N_LASERS", &tuning.lasers, 4, 0, N_LASERS},
+    {"PARTICLE_BUDGET", &tuning.particle_budget, 4, 0, 0xFFFFFFFF},
+    {"BOT_BUDGET", &tuning.bot_budget, 4, 0, 0xFFFFFFFF}
+};
+
+#define N_TUNABLES (sizeof(tunables) / sizeof(tunables[0]))
+
+/* Main loop iterations and frames drawn in the last full second */
+u32 loops_per_s = 0, draws_per_s = 0;
+
+char console_line[CONSOLE_LINE + 1];
+u32 console_len = 0;
+bool console_watch = false;
+
+bool str_eq(const char *a, const char *b)
 {
-  score += value;
-  if (score >= 60 && score < 120 && level < 2) {
-     next_level(2);
-  }
-  if (score >= 120 && score < 180 && level < 3) {
-     next_level(3);
-  }
-  if (score >= 180 && level < 4) {
-     next_level(4);
-  }
-} 
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
 
-/* Try to move the player by dx and return true if successful.
- */
-bool move(s8 dx)
+/* Parse s, in decimal or in hexadecimal after 0x, into *v. Return false if it
+ * is not a number that fits in a u32. */
+bool parse_u32(const char *s, u32 *v)
+{
+    u32 r = 10, d, n = 0;
+
+    if (s[0] == '0' && s[1] == 'x') {
+        r = 16;
+        s += 2;
+    }
+    if (!*s)
+        return false;
+    for (; *s; s++) {
+        if (*s >= '0' && *s <= '9')
+            d = *s - '0';
+        else if (r == 16 && *s >= 'a' && *s <= 'f')
+            d = *s - 'a' + 10;
+        else if (r == 16 && *s >= 'A' && *s <= 'F')
+            d = *s - 'A' + 10;
+        else return false;
+        if (n > (0xFFFFFFFF - d) / r)
+            return false;
+        n = n * r + d;
+    }
+    *v = n;
+    return true;
+}
+
+/* Cut the next space separated word off the front of *s and return it, or ""
+ * at the end of the line. */
+char *console_word(char **s)
+{
+    char *w;
+    while (**s == ' ')
+        (*s)++;
+    w = *s;
+    while (**s && **s != ' ')
+        (*s)++;
+    if (**s)
+        *(*s)++ = 0;
+    return w;
+}
+
+u32 tunable_get(const struct tunable *t)
+{
+    return t->size == 1 ? *(u8 *) t->value : *(u32 *) t->value;
+}
+
+void tunable_put(const struct tunable *t)
+{
+    serial_puts(t->name);
+    serial_putn(" ", tunable_get(t));
+    serial_puts("\n");
+}
+
+/* Return true if the settings give every velocity at least one fixed point
+ * step per tick, at the current level and at any level next_level() sets up
+ * (level 4 moves the enemys and the well at half ENEMYMOVE). FIX_VELOCITY()
+ * truncates anything slower to 0, and then nothing moves. */
+bool console_moves(void)
+{
+    u64 t = (u64) FIX_ONE * tuning.tick;
+    return t >= enemymove && t >= wallmove && t >= tuning.wallmove
+        && t >= 2 * (u64) tuning.enemymove;
+}
+
+/* Bring what follows from the settings up to date after one has changed. */
+void console_retune(void)
+{
+    enemy_vy = FIX_VELOCITY(enemymove);
+    well_vy = FIX_VELOCITY(wallmove);
+    if (cont_enemyspawn > enemyspawn)
+        cont_enemyspawn = enemyspawn;
+    if (cont_tick >= tuning.tick)
+        cont_tick = tuning.tick - 1;
+    if (corridor_x + corridor_w > WELL_WIDTH - 1)
+        corridor_x = WELL_WIDTH - 1 - corridor_w;
+}
+
+void console_stats(void)
 {
+    u32 i, enemys = 0, lasers = 0;
+
+    for (i = 0; i < N_ENEMYS; i++)
+        enemys += enemy[i].alive;
+    for (i = 0; i < N_LASERS; i++)
+        lasers += laser[i].alive;
+    serial_putn("loops/s ", loops_per_s);
+    serial_putn(" frames/s ", draws_per_s);
+    serial_putn(" ticks/ms ", (u32) tpms);
+    serial_putn(" level ", level);
+    serial_putn(" score ", score);
+    serial_putn(" enemys ", enemys);
+    serial_putn(" lasers ", lasers);
+    serial_putn(" particles ", particle_count);
+    serial_putn(" latency us ", latency_p50);
+    serial_putn("/", latency_p99);
+    serial_putn("/", latency_max);
+    serial_putn(" dropped ", COM1->rx_dropped);
+    serial_putn(" overruns ", overruns);
+    if (paused)
+        serial_puts(" paused");
     if (game_over)
+        serial_puts(" game over");
+    serial_puts("\n");
+}
+
+/* Run the command in console_line, and return true if it changed the game. */
+bool console_run(void)
+{
+    char *s = console_line, *cmd, *a, *b;
+    u32 i, v, old;
+
+    cmd = console_word(&s);
+    a = console_word(&s);
+    b = console_word(&s);
+    if (!*cmd)
         return false;
 
-    if(!paused){
-        if(dx < 0 && 2 < player.x){
-    	    player.x += dx;
+    if (str_eq(cmd, "get") || str_eq(cmd, "set")) {
+        for (i = 0; i < N_TUNABLES; i++) {
+            if (*a && !str_eq(a, tunables[i].name))
+                continue;
+            if (*cmd == 's') {
+                if (!parse_u32(b, &v) || v < tunables[i].min
+                        || v > tunables[i].max) {
+                    serial_putn("range ", tunables[i].min);
+                    serial_putn(" to ", tunables[i].max);
+                    serial_puts("\n");
+                    return false;
+                }
+                old = tunable_get(&tunables[i]);
+                if (tunables[i].size == 1)
+                    *(u8 *) tunables[i].value = (u8) v;
+                else *(u32 *) tunables[i].value = v;
+                if (!console_moves()) {
+                    if (tunables[i].size == 1)
+                        *(u8 *) tunables[i].value = (u8) old;
+                    else *(u32 *) tunables[i].value = old;
+                    serial_puts("too slow for TICK, nothing would move\n");
+                    return false;
+                }
+                trace(TRACE_SET, i, v);
+                console_retune();
+                if ((uptr) tunables[i].value >= (uptr) &tuning
+                        && (uptr) tunables[i].value < (uptr) (&tuning + 1))
+                    retuned = true;
+                replay.header.tuned = true;
+            }
+            tunable_put(&tunables[i]);
+            if (*a)
+                return false;
         }
-        if(dx > 0 && player.x < WELL_WIDTH*2){
-    	    player.x += dx;
+        if (*a || *cmd == 's')
+            serial_puts("no such setting\n");
+    } else if (str_eq(cmd, "level")) {
+        if (!parse_u32(a, &v) || v < 1 || v > 4)
+            serial_puts("levels are 1 to 4\n");
+        else if (game_over || rewinding)
+            serial_puts("not now\n");
+        else {
+            clear(BLACK);
+            restart(v);
+            return true;
+        }
+    } else if (str_eq(cmd, "pause")) {
+        if (game_over)
+            serial_puts("not now\n");
+        else {
+            clear(BLACK);
+            paused = !paused;
+            replay_record(REPLAY_PAUSE);
+            return true;
         }
+    } else if (str_eq(cmd, "stats")) {
+        console_stats();
+    } else if (str_eq(cmd, "watch")) {
+        console_watch = !console_watch;
+    } else {
+        serial_puts("get [name], set name value, level n, pause, stats, watch\n");
     }
-    return true;
+    return false;
 }
 
-/* Try to move the player's lasers by 1 in y and return true if successful.
- */
-bool move_playerlasers()
+/* Take in what COM1 has received since the last call, running the first line
+ * completed, and count the loop. Return true if a command changed the game. */
+bool console_poll(void)
 {
-    u8 i, j;
-
-    if (game_over)
-       return false;
+    static u32 loops_mark = 0, draws_mark = 0;
+    static bool cr = false;
+    bool changed;
+    s32 c;
 
-    if(!paused){
-       for (i = 0; i < N_LASERS; i++) {
-         if (laser[i].alive == true && laser[i].y > 1) { // Move lasers if they'are alive
-           laser[i].y += -1;
-           if (laser[i].y <= 1) { // Laser is not alive anymore
-             laser[i].alive = false;
-           }
+    loops++;
+    if (interval(TIMER_CONSOLE, 1000)) {
+        loops_per_s = loops - loops_mark;
+        draws_per_s = draws - draws_mark;
+        loops_mark = loops;
+        draws_mark = draws;
+        if (console_watch)
+            console_stats();
+    }
 
-           for (j = 0; j < N_ENEMYS; j++) { // If enemys collide with lasers
-             if (enemy[j].alive == true) { // If enemy is alive
-               if (laser[i].y == enemy[j].y && ((laser[i].x == enemy[j].x) || (laser[i].x == enemy[j].x + 1) || (laser[i].x + 1 == enemy[j].x))) {
-                 enemy[j].hp += -laser[i].dmg;
-                 laser[i].alive = false; // Laser is not alive anymore 
-                 if (enemy[j].hp <= 0) {
-                   increase_score(3);
-                   enemy[j].alive = false; // Enemy is not alive anymore                   
-                 }      
-               }
-             }
-           } 
-         }        
-       }
+    while ((c = serial_getc()) >= 0) {
+        if (c == '\n' && cr) { /* The rest of a \r\n */
+            cr = false;
+            continue;
+        }
+        cr = c == '\r';
+        if (c == '\r' || c == '\n') {
+            serial_puts("\n");
+            console_line[console_len] = 0;
+            console_len = 0;
+            changed = console_run();
+            serial_puts("> ");
+            return changed;
+        }
+        if ((c == '\b' || c == 0x7F) && console_len) {
+            console_len--;
+            serial_puts("\b \b");
+        } else if (c >= ' ' && c < 0x7F && console_len < CONSOLE_LINE) {
+            console_line[console_len++] = (char) c;
+            serial_putc((char) c);
+        }
     }
-    return true;    
+    return false;
 }
 
-/* Try to move the enemys by 1 in y and return true if successful.
- */
-bool move_enemys()
+/* Crash report
+ *
+ * Each CPU exception vector goes to a stub that saves the general registers
+ * and calls exception(), which reports them with the recent trace events and
+ * the game's counters, on COM1 and on screen. It then waits for a key, or
+ * CRASH_WAIT milliseconds, and resets. */
+
+#ifdef __x86_64__
+#define EXCEPTION_REGS (15)
+#define EXCEPTION_REGS_PER_LINE (3)
+#define EXCEPTION_SAVE \
+    "    push %rax\n    push %rbx\n    push %rcx\n    push %rdx\n" \
+    "    push %rsi\n    push %rdi\n    push %rbp\n    push %r8\n" \
+    "    push %r9\n    push %r10\n    push %r11\n    push %r12\n" \
+    "    push %r13\n    push %r14\n    push %r15\n" \
+    "    mov %rsp, %rdi\n" \
+    "    and $-16, %rsp\n"
+#define EXCEPTION_WORD ".quad"
+
+/* In the order EXCEPTION_SAVE leaves them on the stack */
+const char *const register_names[EXCEPTION_REGS] = {
+    "r15", "r14", "r13", "r12", "r11", "r10", "r9", "r8",
+    "rbp", "rdi", "rsi", "rdx", "rcx", "rbx", "rax"
+};
+#else
+#define EXCEPTION_REGS (8)
+#define EXCEPTION_REGS_PER_LINE (4)
+#define EXCEPTION_SAVE \
+    "    pusha\n" \
+    "    push %esp\n"
+#define EXCEPTION_WORD ".long"
+
+/* In the order pusha leaves them on the stack */
+const char *const register_names[EXCEPTION_REGS] = {
+    "edi", "esi", "ebp", "esp", "ebx", "edx", "ecx", "eax"
+};
+#endif
+
+/* The stack as exception() gets it: the general registers, the vector, the
+ * error code (0 for the exceptions without one), and the CPU's frame */
+struct exception_frame {
+    uptr regs[EXCEPTION_REGS];
+    uptr vector, error, ip, cs, flags;
+#ifdef __x86_64__
+    uptr sp, ss;
+#endif
+};
+
+/* The stubs. Where the CPU pushes no error code, they push a 0 instead, so
+ * that the frame is the same for every vector. */
+asm(".pushsection .text\n"
+    ".irp n, 0, 1, 2, 3, 4, 5, 6, 7, 9, 15, 16, 18, 19, 20, 22, 23, 24, 25, "
+    "26, 27, 28, 31\n"
+    "exception_stub_\\n:\n"
+    "    push $0\n"
+    "    push $\\n\n"
+    "    jmp exception_entry\n"
+    ".endr\n"
+    ".irp n, 8, 10, 11, 12, 13, 14, 17, 21, 29, 30\n"
+    "exception_stub_\\n:\n"
+    "    push $\\n\n"
+    "    jmp exception_entry\n"
+    ".endr\n"
+    "exception_entry:\n"
+    EXCEPTION_SAVE
+    "    call exception\n"
+    ".popsection\n"
+    ".pushsection .data\n"
+    ".globl exception_stubs\n"
+    "exception_stubs:\n"
+    ".irp n, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, "
+    "18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31\n"
+    "    " EXCEPTION_WORD " exception_stub_\\n\n"
+    ".endr\n"
+    ".popsection");
+
+extern const uptr exception_stubs[32];
+
+const char *const exception_names[32] = {
+    "divide error", "debug", "NMI", "breakpoint", "overflow", "bound range",
+    "invalid opcode", "no FPU", "double fault", "FPU segment overrun",
+    "invalid TSS", "segment not present", "stack fault",
+    "general protection", "page fault", "reserved", "x87 error",
+    "alignment check", "machine check", "SIMD error", "virtualisation",
+    "control protection", "reserved", "reserved", "reserved", "reserved",
+    "reserved", "reserved", "hypervisor injection", "VMM communication",
+    "security", "reserved"
+};
+
+/* The report line being put together, and the screen row it goes on */
+char crash_text[COLS + 1];
+u8 crash_len = 0, crash_row = 0;
+
+/* Add s to the report line. */
+void crash_puts(const char *s)
+{
+    for (; *s && crash_len < COLS; s++)
+        crash_text[crash_len++] = *s;
+}
+
+/* Add label and v in hexadecimal. */
+void crash_hex(const char *label, uptr v)
+{
+    crash_puts(label);
+#ifdef __x86_64__
+    crash_puts(itoa((u32) (v >> 32), 16, 8));
+#endif
+    crash_puts(itoa((u32) v, 16, 8));
+}
+
+/* Add label and v in decimal. */
+void crash_dec(const char *label, u32 v)
+{
+    const char *s = itoa(v, 10, 10);
+    while (*s == '0' && s[1])
+        s++;
+    crash_puts(label);
+    crash_puts(s);
+}
+
+/* Send the report line to COM1 and, while there is room, put it on
+ * screen. */
+void crash_line(void)
 {
-    u8 i;
+    crash_text[crash_len] = 0;
+    serial_puts(crash_text);
+    serial_puts("\n");
+    if (crash_row < ROWS - 1)
+        puts(0, crash_row++, BRIGHT | GRAY, BLUE, crash_text);
+    crash_len = 0;
+}
+
+/* Report the exception that left frame f, and reset. A fault while reporting
+ * resets at once. */
+noreturn exception(struct exception_frame *f)
+{
+    static bool crashed = false;
+    const struct trace_event *e;
+    uptr cr0, cr2, cr3;
+    u32 i, n, enemys = 0, lasers = 0;
+    u64 now = rdtsc();
+
+    if (crashed)
+        reset();
+    crashed = true;
+    serial_polled();
+#ifndef __x86_64__
+    f->regs[3] = (uptr) (&f->flags + 1); /* Not what pusha saw */
+#endif
+    asm volatile("mov %%cr0, %0\n\t"
+                 "mov %%cr2, %1\n\t"
+                 "mov %%cr3, %2"
+                 : "=r" (cr0), "=r" (cr2), "=r" (cr3));
 
+    clear(BLUE);
+    serial_puts("\n");
+    crash_dec("CPU exception ", f->vector);
+    crash_puts(": ");
+    crash_puts(exception_names[f->vector % 32]);
+    crash_hex(", error ", f->error);
+    crash_line();
+    crash_hex("ip ", f->ip);
+    crash_hex("  cs ", f->cs);
+    crash_hex("  flags ", f->flags);
+    crash_line();
+#ifdef __x86_64__
+    crash_hex("sp ", f->sp);
+    crash_hex("  ss ", f->ss);
+    crash_line();
+#endif
+    for (i = 0; i < EXCEPTION_REGS; i++) {
+        crash_puts(register_names[EXCEPTION_REGS - 1 - i]);
+        crash_hex(" ", f->regs[EXCEPTION_REGS - 1 - i]);
+        if (i % EXCEPTION_REGS_PER_LINE == EXCEPTION_REGS_PER_LINE - 1
+                || i == EXCEPTION_REGS - 1)
+            crash_line();
+        else crash_puts("  ");
+    }
+    crash_hex("cr0 ", cr0);
+    crash_hex("  cr2 ", cr2);
+    crash_hex("  cr3 ", cr3);
+    crash_line();
+
+    for (i = 0; i < N_ENEMYS; i++)
+        enemys += enemy[i].alive;
+    for (i = 0; i < N_LASERS; i++)
+        lasers += laser[i].alive;
+    crash_dec("level ", level);
+    crash_dec(" score ", score);
+    crash_dec(" seed ", seed);
+    crash_dec(" enemys ", enemys);
+    crash_dec(" lasers ", lasers);
+    crash_dec(" particles ", particle_count);
+    if (paused)
+        crash_puts(" paused");
     if (game_over)
-       return false;
+        crash_puts(" game over");
+    if (rewinding)
+        crash_puts(" rewinding");
+    if (autoplay)
+        crash_puts(" autoplay");
+    crash_line();
+    crash_dec("loop ", loops);
+    crash_puts(" in ");
+    crash_puts(frame_phase < FRAME__LENGTH ? frame_phase_names[frame_phase]
+                                           : "start-up");
+    crash_dec(", frames ", draws);
+    crash_dec(" overruns ", overruns);
+    crash_dec(" ticks/ms ", (u32) tpms);
+    crash_line();
 
-    if(!paused){
-       for (i = 0; i < N_ENEMYS; i++) {
-         if (enemy[i].alive == true && enemy[i].y < WELL_HEIGHT) { // Move enemys if they'are alive
-           enemy[i].y += 1;
-           if (enemy[i].y >= WELL_HEIGHT) { // Enemy is not alive anymore
-             enemy[i].alive = false;
-             switch(level) { // Increase score if level 2 or 4
-             case 2:
-             increase_score(3);
-             break;
-             case 4:
-             increase_score(3);
-             break;  
-             }
-           }
-           // If player collides with enemy
-           if (enemy[i].y == WELL_HEIGHT - 1) {
-             if ((enemy[i].x == player.x) || (enemy[i].x == player.x + 1) || (enemy[i].x + 1 == player.x)) {
-               game_over = true; // GAME OVER    
-             }
-           }   
-         }        
-       }
+    n = trace_count < TRACE_EVENTS ? trace_count : TRACE_EVENTS;
+    crash_dec("last ", n);
+    crash_puts(" events, newest first:");
+    crash_line();
+    for (i = 1; i <= n; i++) {
+        e = &trace_ring[(trace_count - i) % TRACE_EVENTS];
+        crash_dec("  ", ticks_us(now - e->t));
+        crash_dec(" us ago, loop ", e->loop);
+        crash_puts(": ");
+        crash_puts(trace_names[e->kind]);
+        crash_puts(" ");
+        if (e->kind == TRACE_OVERRUN) {
+            crash_puts(frame_phase_names[e->arg]);
+            crash_puts(" ");
+        } else if (e->kind == TRACE_SET) {
+            crash_puts(tunables[e->arg].name);
+            crash_puts(" ");
+        }
+        if (e->kind == TRACE_KEY)
+            crash_puts(itoa(e->value, 16, 2));
+        else crash_dec("", e->value);
+        crash_line();
     }
-    return true;    
+
+    puts(0, ROWS - 1, BLACK, GREEN, " Press any key to reset... ");
+    present();
+    scan();
+    now = rdtsc();
+    while (!scan() && (!tpms || rdtsc() - now < tpms * CRASH_WAIT));
+    reset();
 }
 
-/* Try to move the walls by 1 in y and return true if successful.
- */
-bool move_walls()
+/* Point every exception vector at its stub. */
+void exceptions_init(void)
 {
-    u8 i, j;
+    u8 v;
+    for (v = 0; v < 32; v++)
+        idt_set(v, exception_stubs[v]);
+}
 
-    if (game_over)
-       return false;
+#ifdef STRESS
 
-    if(!paused){
+/* Stress scenario
+ *
+ * The stress build (make lead-stress.elf) boots into this instead of the game.
+ * For n = STRESS_MIN, 2 * STRESS_MIN, ... up to the pool sizes, it fills the
+ * corridor with n enemys and n player lasers placed from STRESS_SEED, and
+ * times each phase of the game on STRESS_FRAMES frames, all starting from that
+ * same state. The fastest frame of each phase is reported in CPU ticks, on
+ * screen and on COM1. */
 
-       for (i = 0; i < N_WALLS; i++) {
-         if (wall[i].alive == true && wall[i].y < WELL_HEIGHT) { // Move walls if they'are alive
-           wall[i].y += 1;
+enum phase {
+    PHASE_LASERS,
+    PHASE_MOVE,
+    PHASE_SPAWN,
+    PHASE_DRAW,
+    PHASE_PRESENT,
+    PHASE__LENGTH
+};
 
-           for (j = 0; j < N_ENEMYS; j++) { // If enemys collide with walls 
-             if (enemy[j].alive == true) { // If enemy is alive
-               switch(wall[i].i) { // If wall orientation is left or right
-                 case 1: // Left
-                     if (wall[i].x == enemy[j].x && wall[i].y == enemy[j].y) {
-                       enemy[j].x += 3;       
-                     }
-                     if (wall[i].x + 1 == enemy[j].x && wall[i].y == enemy[j].y) {
-                       enemy[j].x += 2;         
-                     }
-                     break;
-                 case 2: // Right
-                     if (wall[i].x == enemy[j].x + 1 && wall[i].y == enemy[j].y) {
-                       enemy[j].x += -2;       
-                     }
-                     if (wall[i].x + 1 == enemy[j].x + 1 && wall[i].y == enemy[j].y) {
-                       enemy[j].x += -3;         
-                     }
-                     break;
-               } 
-             }       
-           } 
-           // If player collides with walls
-           if (wall[i].y == WELL_HEIGHT - 1) {
-             if ((wall[i].x == player.x) || (wall[i].x == player.x + 1) || (wall[i].x + 1 == player.x)) {
-               game_over = true; // GAME OVER    
-             }
-           }         
-       
-           if (wall[i].y >= WELL_HEIGHT) { // Wall is not alive anymore
-             wall[i].alive = false;
-             wall[i].x = 0;
-             wall[i].y = 0;
-           }
-         }        
-       }
+#define STRESS_W (10)
+
+const char *const phase_names[PHASE__LENGTH] = {
+    "lasers", "move", "spawn", "draw", "present"
+};
+
+struct State stress_start;
+
+/* Report lines, the header first, kept to redraw the screen after each step */
+char stress_report[ROWS - 2][COLS];
+u8 stress_rows = 0;
+
+/* Set up stress_start with n enemys and n lasers in a straight level 1
+ * corridor. The enemys cannot be killed and stay clear of the player's row
+ * for a frame, and they and the well are about to cross into the next cell,
+ * so every frame does the same work. */
+void stress_fill(u32 n)
+{
+    u32 i;
+
+    srand(STRESS_SEED);
+    score = 0;
+    game_over = false;
+    paused = false;
+    next_level(1);
+    for (i = 0; i < WELL_HEIGHT; i++)
+        move_walls();
+    for (i = 0; i < n; i++) {
+        enemy[i].alive = true;
+        enemy[i].hp = 999;
+        enemy[i].x = rand(corridor_w * 2 - 1) + WELL_X + corridor_x * 2;
+        enemy[i].y = rand(WELL_HEIGHT - 4) + 2;
+        enemy[i].fy = FIX_MASK;
+        enemy[i].vy = enemy_vy;
+        laser[i].alive = true;
+        laser[i].x = rand(corridor_w * 2 - 1) + WELL_X + corridor_x * 2;
+        laser[i].y = rand(WELL_HEIGHT - 4) + 3;
+        laser[i].vy = LASER_VY;
     }
-    return true;    
+    well_fy = FIX_MASK;
+    save_state(&stress_start);
 }
 
-/* Spawns a player's laser.
- */
-void spawn_playerlaser() 
+/* Run one frame from stress_start, keeping the fewest ticks per phase in
+ * best. */
+void stress_frame(u64 *best)
 {
-   u8 i;
-   if (!game_over && !paused) {
+    u64 t[PHASE__LENGTH + 1];
+    u32 p;
 
-   for (i = 0; i < N_LASERS; i++) {
-     if (laser[i].alive == false) { // Search for lasers that aren't alive
-       laser[i].alive = true;
-       laser[i].x = player.x;
-       laser[i].y = WELL_HEIGHT - 2;
-       break;
-     }        
-   }
-   
-   }
+    load_state(&stress_start);
+    t[PHASE_LASERS] = rdtsc();
+    move_playerlasers();
+    t[PHASE_MOVE] = rdtsc();
+    advance();
+    t[PHASE_SPAWN] = rdtsc();
+    spawn_enemy();
+    spawn_playerlaser();
+    t[PHASE_DRAW] = rdtsc();
+    draw();
+    t[PHASE_PRESENT] = rdtsc();
+    present();
+    t[PHASE__LENGTH] = rdtsc();
+    for (p = 0; p < PHASE__LENGTH; p++)
+        if (t[p + 1] - t[p] < best[p])
+            best[p] = t[p + 1] - t[p];
 }
 
-/* Spawns an enemy, with a differential dx.
- */
-void spawn_enemy(s8 dx) 
+/* Write s right-aligned in the STRESS_W columns of field f of report line
+ * r. */
+void stress_field(u8 r, u8 f, const char *s)
 {
-   u8 i;
-   u32 r = 0; // Random range
+    u8 n = 0;
+    while (s[n])
+        n++;
+    memcpy(stress_report[r] + (f + 1) * STRESS_W - n, s, n);
+}
 
-   if (!game_over && !paused) {
+/* Write value v, in decimal, to field f of report line r. */
+void stress_value(u8 r, u8 f, u64 v)
+{
+    const char *s = itoa(v >> 32 ? 0xFFFFFFFF : (u32) v, 10, STRESS_W);
+    while (*s == '0' && s[1])
+        s++;
+    stress_field(r, f, s);
+}
 
-   switch(level) { // Select the range between walls for level
-   case 1:
-       r = rand(WELL_WIDTH - 3) + WELL_WIDTH - WELL_WIDTH/2 + 3 + dx;
-       break;
-   case 2:
-       r = rand(WELL_WIDTH - WELL_WIDTH/4 - 2) + WELL_WIDTH - (WELL_WIDTH/2 - WELL_WIDTH/8) + 3 + dx;
-       break;
-   case 3:
-       r = rand(WELL_WIDTH - WELL_WIDTH/4 - 2) + WELL_WIDTH - (WELL_WIDTH/2 - WELL_WIDTH/8) + 3 + dx;
-       break;
-   case 4:
-       r = rand(WELL_WIDTH/2 - 3) + WELL_WIDTH - WELL_WIDTH/4 + 3 + dx;
-       break;  
-   }
-   
-   for (i = 0; i < N_ENEMYS; i++) {
-     if (enemy[i].alive == false) { // Search for enemys that aren't alive
-       enemy[i].alive = true;
-       enemy[i].x = r;
-       enemy[i].y = 2;
-       switch(level) { // Select the range between walls for level
-       case 1:
-           enemy[i].hp = 2;
-           enemy[i].dmg = 1;  
-           break;
-       case 2:
-           enemy[i].hp = 999;
-           enemy[i].dmg = 1;    
-           break;
-       case 3:
-           enemy[i].hp = 2;
-           enemy[i].dmg = 1;  
-           break;
-       case 4:
-           enemy[i].hp = 999;
-           enemy[i].dmg = 1; 
-           break;  
-       }
-       break;
-     }        
-   }
+/* Start a new, blank report line and return its index. */
+u8 stress_line(void)
+{
+    memset(stress_report[stress_rows], ' ', COLS);
+    return stress_rows++;
+}
+
+/* Send report line r to COM1 and redraw the whole report. */
+void stress_show(u8 r)
+{
+    u8 y;
+    char s[COLS + 1];
+
+    memcpy(s, stress_report[r], COLS);
+    for (y = COLS; y && s[y - 1] == ' '; y--);
+    s[y] = 0;
+    serial_puts(s);
+    serial_puts("\n");
+
+    clear(BLACK);
+    puts(0, 0, BRIGHT | GRAY, BLACK,
+         LEAD_NAME " " LEAD_VERSION " stress: fewest CPU ticks per frame");
+    for (y = 0; y < stress_rows; y++) {
+        memcpy(s, stress_report[y], COLS);
+        s[COLS] = 0;
+        puts(0, y + 2, y ? GRAY : BRIGHT | BLUE, BLACK, s);
+    }
+    present();
+}
+
+noreturn stress(void)
+{
+    u64 best[PHASE__LENGTH];
+    u32 n, f, p;
+    u8 r;
+
+    serial_puts(LEAD_NAME " " LEAD_VERSION " stress: fewest CPU ticks per frame\n");
+    r = stress_line();
+    stress_field(r, 0, "n");
+    for (p = 0; p < PHASE__LENGTH; p++)
+        stress_field(r, p + 1, phase_names[p]);
+    stress_show(r);
+
+    for (n = STRESS_MIN; n <= N_ENEMYS && n <= N_LASERS
+             && stress_rows < ROWS - 2; n *= 2) {
+        stress_fill(n);
+        for (p = 0; p < PHASE__LENGTH; p++)
+            best[p] = ~0ULL;
+        for (f = 0; f < STRESS_FRAMES; f++)
+            stress_frame(best);
+
+        r = stress_line();
+        stress_value(r, 0, n);
+        for (p = 0; p < PHASE__LENGTH; p++)
+            stress_value(r, p + 1, best[p]);
+        stress_show(r);
+    }
+
+    puts(0, ROWS - 1, BLACK, GREEN, " Press any key to restart... ");
+    present();
+    while (!scan());
+    reset();
+}
+
+#endif
+
+#ifdef SESSIONS
+
+/* Sessions
+ *
+ * The sessions build (make lead-sessions.elf) boots into this instead of the
+ * single game: N_SESSIONS games at once, session n played on a terminal on
+ * serial port n + 1 and drawn there with ANSI escape sequences, and one
+ * session at a time shown on the console (F1 and up pick which), where the
+ * keyboard plays it too. Sessions past COM4, or on a port with no UART, play
+ * themselves.
+ *
+ * Each session runs as a task with a stack of its own. The PIT interrupts
+ * SCHED_HZ times a second, ending the running task's turn, and the tasks take
+ * turns in order; a task that has done what fell due gives up the rest of its
+ * turn by VECTOR_YIELD. Task 0 is the boot stack, which drives the console and
+ * halts when it is done. The game keeps its state in globals, so the
+ * scheduler saves them into the session they belong to and loads the next
+ * session's, only when the task to run is another session's. What the
+ * sessions share besides (the bot's scratch state, the widgets and the
+ * drawing) is only used with interrupts off.
+ *
+ * The single game runs one step per main loop iteration, however long an
+ * iteration takes. A session runs SESSION_STEPS steps per millisecond by the
+ * CPU clock instead, catching up on those that fell due while other tasks
+ * ran, so that every session keeps the pace however many there are. High
+ * scores, replays and rewinding keep one game's worth of state, and sessions
+ * go without them. */
+
+/* Terminal input is decoded to these, and so are the console's arrow keys.
+ * They are Ctrl-B and Ctrl-F, back and forward in many a terminal program. */
+#define SESSION_LEFT  (0x02)
+#define SESSION_RIGHT (0x06)
+
+/* Size of a session's ring of keys from the console, a power of two */
+#define SESSION_KEYS (16)
+
+/* The most bytes sending a cell takes: a cursor move, colours, the character */
+#define SESSION_CELL (24)
+
+/* Steps a session runs in one go before it drops the rest of its backlog, a
+ * frame's worth */
+#define SESSION_CATCHUP (SESSION_STEPS * SESSION_FRAME)
+
+struct Session {
+    struct State state; /* The game, while another session's is loaded */
+    u64 timers[TIMER__LENGTH];
+    bool paused, autoplay;
+    u32 start_level;
+    struct Uart *uart; /* The terminal, 0 if there is none */
+    u8 esc; /* Bytes of an escape sequence read so far */
+    u8 keys[SESSION_KEYS];
+    volatile u32 keys_head, keys_tail;
+    u64 clock; /* The CPU tick the next step is due at */
+    u64 frame_at; /* The CPU tick the last frame was drawn at */
+    u32 frames, late; /* Frames drawn, and backlogs dropped */
+    u16 cells[ROWS][COLS]; /* The screen as last drawn */
+    u16 sent[ROWS][COLS]; /* The screen as the terminal shows it */
+    u8 cx, cy; /* The terminal's cursor, cx COLS if not known */
+    u16 attr; /* The terminal's colours, 0xFFFF if not known */
+};
 
-   }
+struct Session session[N_SESSIONS];
+
+/* The session whose game is in the globals, N_SESSIONS for none */
+u32 session_loaded = N_SESSIONS;
+
+/* Save the game in the globals into session n. */
+void session_save(u32 n)
+{
+    struct Session *s = &session[n];
+    save_state(&s->state);
+    memcpy(s->timers, timers, sizeof(timers));
+    s->paused = paused;
+    s->autoplay = autoplay;
 }
 
-/* Spawns a wall in orientation left or rigth, and with a differential dx.
- */
-void spawn_wall(u8 orientation, s8 dx) 
+/* Put the game of session n in the globals, saving the one there. */
+void session_load(u32 n)
 {
-   u8 i;
-   u32 dif = WELL_WIDTH/2;
+    struct Session *s = &session[n];
+    if (session_loaded < N_SESSIONS)
+        session_save(session_loaded);
+    load_state(&s->state);
+    memcpy(timers, s->timers, sizeof(timers));
+    paused = s->paused;
+    autoplay = s->autoplay;
+    session_loaded = n;
+}
 
-   if (!game_over && !paused) {   
+/* Tasks */
 
-   for (i = 0; i < N_WALLS; i++) {
-     if (wall[i].alive == false) { // Search for walls that aren't alive
-       wall[i].alive = true;
-        switch(level) { // Select the range between walls for level
-        case 1:
-            dif = WELL_WIDTH/2;
-            break;
-        case 2:
-            dif = WELL_WIDTH/2 - WELL_WIDTH/8;
-            break;
-        case 3:
-            dif = WELL_WIDTH/2 - WELL_WIDTH/8;
-            break;
-        case 4:
-            dif = WELL_WIDTH/4;
-            break;  
-        }
-       if (orientation == 0) { // If orientation equals left
-         wall[i].i = 1; // Reset id
-         wall[i].x += WELL_WIDTH - dif + 1 + dx;
-       } else { // If orientation equals right
-         wall[i].i = 2; // Reset id
-         wall[i].x += WELL_WIDTH + dif + 1 + dx;
-       }
-       wall[i].y = 2;
-       break;
-     }        
-   }
+#define N_TASKS (1 + N_SESSIONS)
 
-   }
+struct Task {
+    u8 fx[512] __attribute__((aligned(16))); /* The FPU and SSE registers */
+    uptr sp; /* Where the registers are saved, while another task runs */
+};
+
+struct Task tasks[N_TASKS];
+u8 task_stacks[N_SESSIONS][TASK_STACK] __attribute__((aligned(16)));
+u32 task_current = 0;
+
+/* The fxsave area of the running task, for the stubs */
+u8 *task_fx = tasks[0].fx;
+
+/* The stubs save the general registers on the task's stack and the rest in
+ * its fxsave area, call C with the stack pointer, and restore the registers
+ * of whatever task's stack pointer it returns. The general registers go in
+ * the order the crash report has them. */
+#ifdef __x86_64__
+#define TASK_SAVE \
+    "    push %rax\n    push %rbx\n    push %rcx\n    push %rdx\n" \
+    "    push %rsi\n    push %rdi\n    push %rbp\n    push %r8\n" \
+    "    push %r9\n    push %r10\n    push %r11\n    push %r12\n" \
+    "    push %r13\n    push %r14\n    push %r15\n" \
+    "    mov task_fx(%rip), %rax\n" \
+    "    fxsave (%rax)\n" \
+    "    mov %rsp, %rdi\n"
+#define TASK_RESTORE \
+    "    mov %rax, %rsp\n" \
+    "    mov task_fx(%rip), %rax\n" \
+    "    fxrstor (%rax)\n" \
+    "    pop %r15\n    pop %r14\n    pop %r13\n    pop %r12\n" \
+    "    pop %r11\n    pop %r10\n    pop %r9\n    pop %r8\n" \
+    "    pop %rbp\n    pop %rdi\n    pop %rsi\n    pop %rdx\n" \
+    "    pop %rcx\n    pop %rbx\n    pop %rax\n" \
+    "    iretq\n"
+#else
+#define TASK_SAVE \
+    "    pusha\n" \
+    "    mov task_fx, %eax\n" \
+    "    fxsave (%eax)\n" \
+    "    push %esp\n"
+#define TASK_RESTORE \
+    "    mov %eax, %esp\n" \
+    "    mov task_fx, %eax\n" \
+    "    fxrstor (%eax)\n" \
+    "    popa\n" \
+    "    iret\n"
+#endif
+
+asm(".pushsection .text\n"
+    "task_timer_stub:\n"
+    TASK_SAVE
+    "    call task_tick\n"
+    TASK_RESTORE
+    "task_yield_stub:\n"
+    TASK_SAVE
+    "    call schedule\n"
+    TASK_RESTORE
+    ".popsection");
+
+void task_timer_stub(void);
+void task_yield_stub(void);
+
+/* Note that the task whose registers are saved at sp has stopped, and return
+ * where those of the next task in turn are, after loading its game if it is
+ * another session's than the one loaded. */
+uptr schedule(uptr sp)
+{
+    tasks[task_current].sp = sp;
+    task_current = (task_current + 1) % N_TASKS;
+    if (task_current && task_current - 1 != session_loaded)
+        session_load(task_current - 1);
+    task_fx = tasks[task_current].fx;
+    return tasks[task_current].sp;
 }
 
-/* Update the game state. Called at an interval relative to the current level.
- */
-void update(void)
+/* The PIT's IRQ, which ends the running task's turn. */
+uptr task_tick(uptr sp)
 {
-    move_playerlasers();
+    irq_eoi();
+    return schedule(sp);
 }
 
-#define TITLE_X (COLS / 2 - 9)
-#define TITLE_Y (ROWS / 2 - 1)
+/* Set task t up to start at entry, with interrupts on, on its first turn. The
+ * stack is laid out as the stubs leave it, with the registers zero. */
+void task_start(u32 t, void (*entry)(void))
+{
+    uptr *sp = (uptr *) (task_stacks[t - 1] + TASK_STACK);
+    uptr cs;
+    u32 i;
 
-/* Draw about information in the centre. Shown on boot and pause. */
-void draw_about(void) {
-    puts(TITLE_X,      TITLE_Y,     BLACK,            RED,     "   ");
-    puts(TITLE_X + 3,  TITLE_Y,     BLACK,            MAGENTA, "   ");
-    puts(TITLE_X + 6,  TITLE_Y,     BLACK,            BLUE,    "   ");
-    puts(TITLE_X + 9,  TITLE_Y,     BLACK,            GREEN,   "   ");
-/*    puts(TITLE_X + 12, TITLE_Y,     BLACK,            YELLOW,  "   ");
-    puts(TITLE_X + 15, TITLE_Y,     BLACK,            CYAN,    "   ");*/
-    puts(TITLE_X,      TITLE_Y + 1, BRIGHT | RED,     RED,     " L ");
-    puts(TITLE_X + 3,  TITLE_Y + 1, BRIGHT | MAGENTA, MAGENTA, " E ");
-    puts(TITLE_X + 6,  TITLE_Y + 1, BRIGHT | BLUE,    BLUE,    " A ");
-    puts(TITLE_X + 9,  TITLE_Y + 1, BRIGHT | GREEN,   GREEN,   " D ");
-/*    puts(TITLE_X + 12, TITLE_Y + 1, BRIGHT | YELLOW,  YELLOW,  "   ");
-    puts(TITLE_X + 15, TITLE_Y + 1, BRIGHT | CYAN,    CYAN,    "   ");*/
-    puts(TITLE_X,      TITLE_Y + 2, BLACK,            RED,     "   ");
-    puts(TITLE_X + 3,  TITLE_Y + 2, BLACK,            MAGENTA, "   ");
-    puts(TITLE_X + 6,  TITLE_Y + 2, BLACK,            BLUE,    "   ");
-    puts(TITLE_X + 9,  TITLE_Y + 2, BLACK,            GREEN,   "   ");
-/*    puts(TITLE_X + 12, TITLE_Y + 2, BLACK,            YELLOW,  "   ");
-    puts(TITLE_X + 15, TITLE_Y + 2, BLACK,            CYAN,    "   ");*/
-    
-    puts(4,  TITLE_Y + 8, BRIGHT | GRAY, BLACK, " Edgar Parra Barillas");
-    puts(4,  TITLE_Y + 7, BRIGHT | GRAY, BLACK, " Ricardo Viquez Mora");
-    puts(4,  TITLE_Y + 6, BRIGHT | GRAY, BLACK, " Jefri Cardenas Villatoro");
+    asm volatile("mov %%cs, %0" : "=r" (cs));
+    *--sp = 0; /* The return address of entry, which never returns */
+#ifdef __x86_64__
+    uptr ss;
+    asm volatile("mov %%ss, %0" : "=r" (ss));
+    sp -= 2;
+    sp[1] = ss;
+    sp[0] = (uptr) (sp + 2);
+#endif
+    *--sp = 0x202; /* Interrupts on */
+    *--sp = cs;
+    *--sp = (uptr) entry;
+    for (i = 0; i < EXCEPTION_REGS; i++)
+        *--sp = 0;
+    tasks[t].sp = (uptr) sp;
+    asm volatile("fxsave %0" : "=m" (tasks[t].fx));
+}
 
-    puts(4,  2, BRIGHT | GRAY, BLACK, "Principios de Sistemas Operativos");
-    puts(4,  1, BRIGHT | GRAY, BLACK, "Profesor: Ernesto Rivera Alvarado");
-    puts(0, ROWS - 1, BRIGHT | BLACK, BLACK,
-         LEAD_NAME " " LEAD_VERSION " " LEAD_URL);
+/* Start the PIT interrupting SCHED_HZ times a second. */
+void sched_start(void)
+{
+    u16 div = 1193182 / SCHED_HZ;
+    idt_set(IRQ_BASE, (uptr) task_timer_stub);
+    idt_set(VECTOR_YIELD, (uptr) task_yield_stub);
+    outb(0x43, 0x34); /* Channel 0, rate generator */
+    outb(0x40, (u8) div);
+    outb(0x40, (u8) (div >> 8));
+    irq_unmask(0);
 }
 
-#define WELL_X (2)
+/* Give up the rest of the turn. */
+static inline void yield(void)
+{
+    asm volatile("int %0" : : "i" (VECTOR_YIELD) : "memory");
+}
 
-#define STATUS_X (COLS * 3/4)
-#define STATUS_Y (ROWS / 2 - 4)
+/* Terminals */
 
-#define SCORE_X STATUS_X
-#define SCORE_Y (ROWS / 2 - 1)
+/* ANSI colour numbers of the VGA colours */
+const u8 ansi_colors[8] = {0, 4, 2, 6, 1, 5, 3, 7};
 
-#define LEVEL_X SCORE_X
-#define LEVEL_Y (SCORE_Y + 4)
+/* Return the character to send for c: the sprite glyphs loaded into the VGA
+ * font go back to the characters they stand for. */
+char session_char(u8 c)
+{
+    u32 i;
+    if (c >= GLYPH_FIRST && c <= GLYPH_LAST) {
+        for (i = 0; i < SPRITE__LENGTH; i++) {
+            if ((u8) sprite_text[i][0] == c)
+                return sprites[i].text[0];
+            if ((u8) sprite_text[i][1] == c)
+                return sprites[i].text[1];
+        }
+    }
+    return c >= ' ' && c < 0x7F ? c : ' ';
+}
 
-/* Draw the well, current tetrimino, its ghost, the preview tetrimino, the
- * status, score and level indicators. Each well/tetrimino cell is drawn one
- * screen-row high and two screen-columns wide. The top two rows of the well
- * are hidden. Rows in the cleared_rows array are drawn as white rather than
- * their actual colors. */
-void draw(void)
+/* Send n, under 1000, in decimal. */
+void session_num(struct Uart *u, u32 n)
 {
-    u8 x, y, i;
+    if (n >= 100)
+        uart_putc(u, '0' + n / 100);
+    if (n >= 10)
+        uart_putc(u, '0' + n / 10 % 10);
+    uart_putc(u, '0' + n % 10);
+}
 
-    if (paused) {
-        draw_about();
-        goto status;
+/* Clear the terminal of session s and have it sent every cell again. */
+void session_reset(struct Session *s)
+{
+    uart_puts(s->uart, "\033[0m\033[2J\033[?25l");
+    memset(s->sent, 0, sizeof(s->sent));
+    s->cx = COLS;
+    s->attr = 0xFFFF;
+}
+
+/* Send the terminal of session s the cells that differ from what it shows,
+ * for as long as there is room to queue them. A terminal that falls behind
+ * catches up over the next frames rather than holding the session up. */
+void session_send(struct Session *s)
+{
+    u8 x, y, fg, bg;
+    u16 z;
+
+    for (y = 0; y < ROWS; y++) {
+        for (x = 0; x < COLS; x++) {
+            z = s->cells[y][x];
+            if (z == s->sent[y][x])
+                continue;
+            if (uart_room(s->uart) < SESSION_CELL)
+                return;
+            if (x != s->cx || y != s->cy) {
+                uart_puts(s->uart, "\033[");
+                session_num(s->uart, y + 1);
+                uart_putc(s->uart, ';');
+                session_num(s->uart, x + 1);
+                uart_putc(s->uart, 'H');
+            }
+            if (z >> 8 != s->attr) {
+                fg = z >> 8 & 0xF;
+                bg = z >> 12;
+                uart_puts(s->uart, "\033[");
+                session_num(s->uart, (fg & BRIGHT ? 90 : 30) + ansi_colors[fg & 7]);
+                uart_putc(s->uart, ';');
+                session_num(s->uart, (bg & BRIGHT ? 100 : 40) + ansi_colors[bg & 7]);
+                uart_putc(s->uart, 'm');
+                s->attr = z >> 8;
+            }
+            uart_putc(s->uart, session_char(z));
+            s->sent[y][x] = z;
+            s->cx = x + 1;
+            s->cy = y;
+        }
     }
+}
 
-    // Border
-    for (y = 2; y < WELL_HEIGHT; y++) {
-        putc(WELL_X - 1,            y, BLACK, GRAY, ' ');
-       // putc(COLS / 2 + 2,          y, BLACK, GRAY, ' ');
-        putc(WELL_WIDTH*2 + 2,          y, BLACK, GRAY, ' ');
+/* Draw the game in the globals into the cells of session s. */
+void session_draw(struct Session *s)
+{
+    uptr flags = irq_save();
+    screen_target = s->cells[0];
+    clear(BLACK);
+    draw();
+    screen_target = 0;
+    irq_restore(flags);
+}
+
+/* Act on key c, as the main loop does on a key press. */
+void session_key(struct Session *s, u8 c)
+{
+    switch (c) {
+    case SESSION_LEFT:
+        move(-1);
+        break;
+    case SESSION_RIGHT:
+        move(1);
+        break;
+    case ' ':
+        spawn_playerlaser();
+        break;
+    case 'a':
+        autoplay = !autoplay;
+        break;
+    case 'p':
+        if (!game_over)
+            paused = !paused;
+        break;
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+        if (game_over) {
+            s->start_level = c - '0';
+            restart(s->start_level);
+        } else paused = !paused;
+        break;
+    case '\r':
+    case '\n':
+        if (game_over)
+            restart(s->start_level);
+        break;
+    case '\f': /* Ctrl-L, after the terminal was reconnected */
+        if (s->uart)
+            session_reset(s);
+        break;
     }
-    for (x = 0; x < WELL_WIDTH * 2 + 2; x++)
-        putc(WELL_X + x - 1, WELL_HEIGHT, BLACK, GRAY, ' ');
+}
 
-    // Well 
-    for (y = 0; y < 2; y++)
-        for (x = 0; x < WELL_WIDTH; x++)
-            puts(WELL_X + x * 2, y, BLACK, BLACK, "  ");
-    for (y = 2; y < WELL_HEIGHT; y++)
-        for (x = 0; x < WELL_WIDTH; x++)
-            if (well[y][x])
-                puts(WELL_X + x * 2, y, BLACK, well[y][x], "  ");
-            else
-                puts(WELL_X + x * 2, y, BRIGHT, BLACK, "::");
+/* Take the keys session s got since its last turn, from the console and from
+ * its terminal. The arrow keys come from a terminal as ESC [ D and ESC [ C,
+ * or ESC O D and ESC O C. */
+void session_input(struct Session *s)
+{
+    s32 c;
 
-    // Player
-     puts(player.x, WELL_HEIGHT - 1, BRIGHT, YELLOW, "^^");
+    while (s->keys_tail != s->keys_head) {
+        session_key(s, s->keys[s->keys_tail % SESSION_KEYS]);
+        s->keys_tail++;
+    }
+    while (s->uart && (c = uart_getc(s->uart)) >= 0) {
+        if (s->esc == 0 && c == 0x1B) {
+            s->esc = 1;
+            continue;
+        }
+        if (s->esc == 1) {
+            s->esc = c == '[' || c == 'O' ? 2 : 0;
+            continue;
+        }
+        if (s->esc == 2) {
+            s->esc = 0;
+            c = c == 'D' ? SESSION_LEFT : c == 'C' ? SESSION_RIGHT : 0;
+        }
+        session_key(s, c);
+    }
+}
 
-    // Enemys
-    for (i = 0; i < N_ENEMYS; i++) {
-      if (enemy[i].alive == true) { // Draws enemys if they'are alive
-        switch(level) { // Show enemys for level
-        case 1:
-            puts(enemy[i].x, enemy[i].y, RED, GRAY, "VV");
-            break;
-        case 2:
-            puts(enemy[i].x, enemy[i].y, YELLOW, BLACK, "OO");
-            break;
-        case 3:
-            puts(enemy[i].x, enemy[i].y, GRAY, BLUE, "XX");
-            break;
-        case 4:
-            puts(enemy[i].x, enemy[i].y, YELLOW, GRAY, "S)");
-            break;  
+/* Run the session of the task, whose game is in the globals whenever the task
+ * runs. Every turn, run the steps that fell due since the last, the bot and
+ * the keys, and every SESSION_FRAME milliseconds draw and send a frame. */
+noreturn session_task(void)
+{
+    struct Session *s = &session[task_current - 1];
+    u32 step_ticks = (u32) tpms / SESSION_STEPS, n;
+    bool updated;
+    uptr flags;
+    u64 now;
+
+    while (1) {
+        updated = false;
+        now = rdtsc();
+        for (n = 0; now - s->clock >= step_ticks; n++) {
+            if (n == SESSION_CATCHUP) {
+                s->clock = now;
+                s->late++;
+                break;
+            }
+            s->clock += step_ticks;
+            if (step())
+                updated = true;
         }
-      }        
+        if (autoplay && updated && !paused && !game_over) {
+            flags = irq_save();
+            bot();
+            irq_restore(flags);
+        }
+
+        session_input(s);
+        if (!paused && !game_over && interval(TIMER_UPDATE, speed))
+            update();
+        if (game_over && autoplay && !s->uart)
+            restart(s->start_level);
+
+        if (now - s->frame_at >= tpms * SESSION_FRAME) {
+            s->frame_at = now;
+            session_draw(s);
+            s->frames++;
+            if (s->uart)
+                session_send(s);
+        }
+        yield();
     }
+}
 
-    // Player Lasers
-    for (i = 0; i < N_LASERS; i++) {
-      if (laser[i].alive == true) { // Draws lasers if they'are alive
-        puts(laser[i].x, laser[i].y, RED, BLACK, "||");
-      }        
+/* The console's keys, as a session takes them */
+u8 session_keymap(u8 key)
+{
+    switch (key) {
+    case KEY_LEFT:
+        return SESSION_LEFT;
+    case KEY_RIGHT:
+        return SESSION_RIGHT;
+    case KEY_SPACE:
+        return ' ';
+    case KEY_A:
+        return 'a';
+    case KEY_P:
+        return 'p';
+    case KEY_ENTER:
+        return '\r';
+    case KEY_1:
+    case KEY_2:
+    case KEY_3:
+    case KEY_4:
+        return '1' + key - KEY_1;
+    default:
+        return 0;
     }
+}
 
-    // Walls
-    for (i = 0; i < N_WALLS; i++) {
-      if (wall[i].alive == true) { // Draws walls if they'are alive
-        switch(level) { // Show walls for level
-        case 1:
-            puts(wall[i].x, wall[i].y, MAGENTA, RED, "[]");
-            break;
-        case 2:
-            puts(wall[i].x, wall[i].y, BLACK, YELLOW, "[]");
-            break;
-        case 3:
-            puts(wall[i].x, wall[i].y, RED, BLUE, "[]");
-            break;
-        case 4:
-            puts(wall[i].x, wall[i].y, CYAN, MAGENTA, "[]");
-            break;  
+#define SESSION_BAR_X (COLS - 20)
+
+/* Copy the cells of session n to the screen, under a bar saying which it is
+ * and how many backlogs it dropped. */
+void session_show(u32 n)
+{
+    struct Session *s = &session[n];
+    uptr flags = irq_save();
+    u8 x, y;
+    u16 z;
+
+    for (y = 0; y < ROWS; y++) {
+        for (x = 0; x < COLS; x++) {
+            z = s->cells[y][x];
+            putc(x, y, z >> 8 & 0xF, z >> 12, (char) z);
         }
-      }        
     }
+    puts(SESSION_BAR_X, 0, BLACK, GREEN, " SESSION           ");
+    puts(SESSION_BAR_X + 9, 0, BLACK, GREEN, itoa(n + 1, 10, 2));
+    puts(SESSION_BAR_X + 11, 0, BLACK, GREEN, s->uart ? " ON COM" : " AUTO");
+    if (s->uart)
+        putc(SESSION_BAR_X + 18, 0, BLACK, GREEN, '1' + (s->uart - uarts));
+    puts(SESSION_BAR_X, 1, GREEN, BLACK, " late:");
+    puts(SESSION_BAR_X + 9, 1, GREEN, BLACK, itoa(s->late, 10, 10));
+    irq_restore(flags);
+}
 
-status:
-    if (paused)
-        puts(STATUS_X + 2, STATUS_Y, BRIGHT | YELLOW, BLACK, "PAUSED");
-    if (game_over)
-        puts(STATUS_X, STATUS_Y, BRIGHT | RED, BLACK, "GAME OVER");
+noreturn sessions(void)
+{
+    struct Session *s;
+    u32 i, shown = 0, frames = 0, itpms;
+    u8 key, c;
 
-    // Score 
-    puts(SCORE_X + 7, SCORE_Y, BLUE, BLACK, "SCORE");
-    puts(SCORE_X + 5, SCORE_Y + 2, BRIGHT | BLUE, BLACK, itoa(score, 10, 10));
+    clear(BLACK);
+    draw_about();
+    present();
 
-    // Level 
-    puts(LEVEL_X + 7, LEVEL_Y, BLUE, BLACK, "LEVEL");
-    puts(LEVEL_X + 5, LEVEL_Y + 2, BRIGHT | BLUE, BLACK, itoa(level, 10, 10));
+    /* Wait a full second to calibrate timing, which the sessions keep to. */
+    tps();
+    itpms = tpms; while (tpms == itpms) tps();
+    itpms = tpms; while (tpms == itpms) tps();
+
+    /* Terminal sessions start on the title, the others playing themselves */
+    save_state(&fresh);
+    for (i = 0; i < N_SESSIONS; i++) {
+        s = &session[i];
+        if (i < N_UARTS) {
+            uart_init(&uarts[i]);
+            uart_irq_start(&uarts[i]);
+            if (uarts[i].irq)
+                s->uart = &uarts[i];
+        }
+        s->start_level = 1;
+        restart(s->start_level);
+        autoplay = !s->uart;
+        paused = !autoplay;
+        session_save(i);
+        if (s->uart)
+            session_reset(s);
+        s->clock = rdtsc();
+        task_start(i + 1, session_task);
+    }
+    sched_start();
+    irq_start();
+
+    while (1) {
+        key = scan();
+        s = &session[shown];
+        if (key >= KEY_F1 && key < KEY_F1 + N_SESSIONS) {
+            shown = key - KEY_F1;
+            s = &session[shown];
+            frames = s->frames - 1;
+        } else if ((c = session_keymap(key))
+                   && s->keys_head - s->keys_tail < SESSION_KEYS) {
+            s->keys[s->keys_head % SESSION_KEYS] = c;
+            s->keys_head++;
+        }
+        if (s->frames != frames) {
+            frames = s->frames;
+            session_show(shown);
+            present();
+        }
+        asm volatile("hlt");
+    }
 }
 
+#endif
 
-noreturn main()
+
+noreturn main(const struct multiboot_info *mbi, u32 magic)
 {
+    serial_init();
+    gfx_init(mbi, magic);
+    sprite_init();
+    if (!gfx)
+        font_load();
+    irq_init();
+    exceptions_init();
+
+    // Inicialize game speed
+    double speed_s = pow(0.8 - (10) * 0.007, (10));
+    speed = speed_s * 1000;
+
+#ifdef STRESS
+    stress();
+#endif
+#ifdef SESSIONS
+    sessions();
+#endif
+    serial_irq_start();
+    irq_start();
+    serial_puts("console: get, set, level, pause, stats, watch\n> ");
+    scores_load();
     clear(BLACK);
     draw_about();
     puts(TITLE_X - 8,  TITLE_Y + 10, BLACK,            GREEN,   " Press any key to continue... ");
+    present();
 
     /* Wait a full second to calibrate timing. */
     u32 itpms;
@@ -876,132 +4617,44 @@ noreturn main()
 
     // Wait for a "press key to continue"
     while (1) {
-      if ((start_key = scan())) {
+      if ((start_key = scan()))
        break;
-      }
       tps();
     }
 
-    // Inicialize game speed
-    double speed_s = pow(0.8 - (10) * 0.007, (10));
-    speed = speed_s * 1000;
-
-        switch(start_key) {
-        case KEY_1:
-            next_level(1);
-            break;
-        case KEY_2:
-            next_level(2);
-            break;
-        case KEY_3:
-            next_level(3);
-            break;
-        case KEY_4:
-            next_level(4);
-            break;
-        default:
-            next_level(1);   
-        }
+    // Keys 1 to 4 pick the starting level
+    u32 start_level = 1;
+    if (start_key >= KEY_1 && start_key <= KEY_4)
+        start_level = start_key - KEY_1 + 1;
+    save_state(&fresh);
+    restart(start_level);
+    trace(TRACE_LEVEL, 0, level);
 
     clear(BLACK);
     draw();
+    effects = true;
 
     bool debug = false, help = false;
-    u8 last_key;
+    u8 last_key = 0;
 loop:
+    frame_begin();
     tps();
 
-    if (debug) {
-        u32 i;
-        puts(0,  0, BRIGHT | GREEN, BLACK, "RTC sec:");
-        puts(10, 0, GREEN,          BLACK, itoa(rtcs(), 16, 2));
-        puts(0,  1, BRIGHT | GREEN, BLACK, "ticks/ms:");
-        puts(10, 1, GREEN,          BLACK, itoa(tpms, 10, 10));
-        puts(0,  2, BRIGHT | GREEN, BLACK, "key:");
-        puts(10, 2, GREEN,          BLACK, itoa(last_key, 16, 2));
-        for (i = 0; i < TIMER__LENGTH; i++) {
-            puts(0,  7 + i, BRIGHT | GREEN, BLACK, "timer:");
-            puts(10, 7 + i, GREEN,          BLACK, itoa(timers[i], 10, 10));
-        }
-    }
-
-    if (help) {
-        puts(1, 12, BRIGHT | BLUE, BLACK, "LEFT");
-        puts(7, 12, BLUE,          BLACK, "- Move left");
-        puts(1, 13, BRIGHT | BLUE, BLACK, "RIGHT");
-        puts(7, 13, BLUE,          BLACK, "- Move right");
-        puts(1, 14, BRIGHT | BLUE, BLACK, "SPACE BAR");
-        puts(7, 14, BLUE,          BLACK, "- Shoot");
-        puts(1, 17, BRIGHT | BLUE, BLACK, "P");
-        puts(7, 17, BLUE,          BLACK, "- Pause");
-        puts(1, 18, BRIGHT | BLUE, BLACK, "D");
-        puts(7, 18, BLUE,          BLACK, "- Toggle debug info");
-        puts(1, 19, BRIGHT | BLUE, BLACK, "H");
-        puts(7, 19, BLUE,          BLACK, "- Toggle help");
-    }
-
-  bool updated = false;
-  if (level == 2 || level == 3 || level == 4) {
-    if (cont_start_dx > 0) { // Update dx for spawn of walls and enemys once cont_start_dx reaches zero
-      cont_start_dx += -1;
-    } else {
-
-      if (cont_wallspawn <= 0) { // If walls are ready to spawn
-        cont_repeat += -1;
-
-          switch(direction[cont_change]) { // Select direction
-          case 0:
-              dx += - 1;
-              break;
-          case 1:
-              dx += 1;
-              break;
-          }
-
-        if (cont_repeat <= 0) { // Change direction
-          cont_repeat = REPEATMOVE;
-          cont_change += 1;
-          if (cont_change >= DIRECTIONSIZE) { // Finishes update for dx of walls and enemys 
-            cont_change = 0;
-            cont_start_dx = startwallchange;
-          }
-        }
-      }
-    }
-  }
-    if (cont_wallspawn > 0) { // Spawns a wall once counter reaches zero
-      cont_wallspawn += -1;
-    } else {
-      cont_wallspawn = wallspawn;
-      spawn_wall(0, dx);
-      spawn_wall(1, dx);
-      updated = true;
-    }
-    if (cont_enemyspawn > 0) { // Spawns an enemy once counter reaches zero
-      cont_enemyspawn += -1;
-    } else {
-      cont_enemyspawn = enemyspawn;
-      spawn_enemy(dx);
-      updated = true;
-    }
-    if (cont_wallmove > 0) { // Moves walls once counter reaches zero
-      cont_wallmove += -1;
-    } else {
-      cont_wallmove = wallmove;
-      move_walls();
-      updated = true;
-    }
-    if (cont_enemymove > 0) { // Moves enemys once counter reaches zero
-      cont_enemymove += -1;
-    } else {
-      cont_enemymove = enemymove;
-      move_enemys();
-      updated = true;
+    bool updated = false;
+    if (!rewinding) {
+        updated = step();
+        replay_step();
     }
+    frame_enter(FRAME_BOT);
+    if (autoplay && updated && !paused && !game_over)
+        bot();
 
+    frame_enter(FRAME_INPUT);
     u8 key;
     if ((key = scan())) {
         last_key = key;
+        trace(TRACE_KEY, 0, key);
+        input_stamp = scan_stamp;
         switch(key) {
         case KEY_D:
             debug = !debug;
@@ -1017,55 +4670,111 @@ loop:
             break;
         case KEY_LEFT:
             move(-1);
+            replay_record(REPLAY_LEFT);
             break;
         case KEY_RIGHT:
             move(1);
+            replay_record(REPLAY_RIGHT);
             break;
         case KEY_SPACE:
             spawn_playerlaser();
+            replay_record(REPLAY_FIRE);
             break;
-        case KEY_P:
-            if (game_over)
-                break;
+        case KEY_A:
+            autoplay = !autoplay;
             clear(BLACK);
-            paused = !paused;
             break;
-        case KEY_1:
-            if (game_over)
+        case KEY_R:
+            if (paused || rewinding)
                 break;
             clear(BLACK);
-            paused = !paused;
+            rewind_start();
             break;
-        case KEY_2:
+        case KEY_R | KEY_RELEASE:
+            if (rewinding)
+                rewind_stop();
+            break;
+        case KEY_P:
             if (game_over)
                 break;
             clear(BLACK);
             paused = !paused;
+            replay_record(REPLAY_PAUSE);
             break;
+        case KEY_1:
+        case KEY_2:
         case KEY_3:
-            if (game_over)
+        case KEY_4:
+            if (game_over) {
+                if (!replay_scored) /* Not in the high scores yet */
+                    break;
+                clear(BLACK);
+                start_level = key - KEY_1 + 1;
+                restart(start_level);
                 break;
+            }
             clear(BLACK);
             paused = !paused;
+            replay_record(REPLAY_PAUSE);
             break;
-        case KEY_4:
-            if (game_over)
+        case KEY_ENTER:
+            if (!game_over || !replay_scored)
                 break;
             clear(BLACK);
-            paused = !paused;
+            restart(start_level);
             break;
         }
+        input_stamp = 0;
         updated = true;
     }
+    frame_enter(FRAME_CONSOLE);
+    if (console_poll())
+        updated = true;
 
-    if (!paused && !game_over && interval(TIMER_UPDATE, speed)) {
+    frame_enter(FRAME_UPDATE);
+    if (!paused && !game_over && !rewinding && interval(TIMER_UPDATE, speed)) {
+        if (lasers_flying())
+            replay_record(REPLAY_UPDATE);
         update();
         updated = true;
     }
 
+    frame_enter(FRAME_EFFECTS);
+    if (!paused && interval(TIMER_PARTICLES, PARTICLE_INTERVAL)
+            && particles_update())
+        updated = true;
+
+    frame_enter(FRAME_REWIND);
+    if (rewinding) {
+        if (interval(TIMER_REWIND, REWIND_INTERVAL)) {
+            rewind_step();
+            updated = true;
+        }
+    } else if (!paused && !game_over && interval(TIMER_REWIND, REWIND_INTERVAL))
+        rewind_capture();
+
+    frame_enter(FRAME_DISK);
+    if (game_over && !replay_scored) {
+        trace(TRACE_GAME_OVER, 0, score);
+        scores_game_over();
+        replay_scored = true;
+    }
+    disk_poll();
+
+    frame_enter(FRAME_DRAW);
     if (updated) {
         draw();
+        draws++;
     }
+    if (debug)
+        draw_debug(last_key);
+    if (help)
+        widget_draw(&help_widget, 0);
+    frame_enter(FRAME_PRESENT);
+    present();
+    if (latency_from)
+        latency_shown();
+    frame_end();
 
     goto loop;
 }
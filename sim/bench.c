@@ -0,0 +1,139 @@
+/* Measure how many game steps per second a batch runs, playing random inputs,
+ * and with -v check the first games against the single-game kernel from
+ * lead.c after every frame.
+ *
+ * Usage: leadsim-bench [-v] [games [threads [frames [level]]]] */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "leadsim.h"
+#include "kernel.h"
+
+/* Iterations of step() per frame, roughly what the main loop runs between
+ * two update()s */
+#define FRAME_STEPS (5000)
+
+/* Per-game input generator, independent of the games' own */
+static uint8_t next_action(uint32_t *x)
+{
+    *x = *x * 1103515245 + 12345;
+    switch ((*x >> 16) % 5) {
+    case 0:
+        return LEADSIM_LEFT;
+    case 1:
+        return LEADSIM_RIGHT;
+    case 2:
+    case 3:
+        return LEADSIM_FIRE;
+    default:
+        return LEADSIM_STAY;
+    }
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t games = 4096, threads = 0, frames = 2000, level = 1;
+    uint32_t g, f, checked = 0, *seeds, *inputs;
+    uint8_t *actions;
+    struct leadsim_game a, b;
+    struct leadsim *s;
+    uint32_t reached[5] = {0};
+    int verify = 0, i = 1, over = 0;
+    double t, busy = 0;
+
+    if (i < argc && !strcmp(argv[i], "-v")) {
+        verify = 1;
+        i++;
+    }
+    if (i < argc)
+        games = strtoul(argv[i++], NULL, 0);
+    if (i < argc)
+        threads = strtoul(argv[i++], NULL, 0);
+    if (i < argc)
+        frames = strtoul(argv[i++], NULL, 0);
+    if (i < argc)
+        level = strtoul(argv[i++], NULL, 0);
+    if (!games || level < 1 || level > 4) {
+        fprintf(stderr, "usage: %s [-v] [games [threads [frames [level]]]]\n",
+                argv[0]);
+        return 2;
+    }
+
+    seeds = malloc(games * sizeof(*seeds));
+    inputs = malloc(games * sizeof(*inputs));
+    actions = malloc(games);
+    s = leadsim_new(games, threads);
+    if (!seeds || !inputs || !actions || !s) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (g = 0; g < games; g++) {
+        seeds[g] = 0x9E3779B9u * (g + 1);
+        inputs[g] = g;
+    }
+    leadsim_reset(s, seeds, level);
+    if (verify) {
+        checked = games < KERNEL_GAMES ? games : KERNEL_GAMES;
+        for (g = 0; g < checked; g++)
+            kernel_reset(g, seeds[g], level);
+    }
+
+    for (f = 0; f < frames; f++) {
+        for (g = 0; g < games; g++)
+            actions[g] = next_action(&inputs[g]);
+
+        t = now();
+        leadsim_input(s, actions);
+        leadsim_step(s, FRAME_STEPS);
+        leadsim_update(s);
+        busy += now() - t;
+
+        for (g = 0; g < checked; g++) {
+            kernel_frame(g, actions[g], FRAME_STEPS);
+            memset(&a, 0, sizeof(a));
+            memset(&b, 0, sizeof(b));
+            leadsim_get(s, g, &a);
+            kernel_get(g, &b);
+            if (memcmp(&a, &b, sizeof(a))) {
+                size_t o = 0;
+                while (((uint8_t *) &a)[o] == ((uint8_t *) &b)[o])
+                    o++;
+                printf("game %u diverged at frame %u (byte %zu): "
+                       "batch score %u level %u, kernel score %u level %u\n",
+                       g, f, o, a.score, a.level, b.score, b.level);
+                return 1;
+            }
+        }
+    }
+
+    for (g = 0; g < games; g++) {
+        leadsim_get(s, g, &a);
+        over += a.game_over;
+        reached[a.level < 5 ? a.level : 0]++;
+    }
+    printf("%u games x %u steps in %.3f s: %.1f M steps/s, %d game over\n",
+           games, frames * FRAME_STEPS, busy,
+           (double) games * frames * FRAME_STEPS / busy / 1e6, over);
+    printf("games ending at level 1-4: %u %u %u %u\n",
+           reached[1], reached[2], reached[3], reached[4]);
+    if (verify)
+        printf("%u games match the single-game kernel\n", checked);
+
+    leadsim_free(s);
+    free(actions);
+    free(inputs);
+    free(seeds);
+    return 0;
+}
@@ -0,0 +1,104 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+/* Digests of a build of lead.c, included after it, for telling whether two
+ * builds play the same game. Only what the player can see is covered: the
+ * pieces alive, the score, level and terrain, and the screen as draw() leaves
+ * it. How a build keeps its counters, fractions and velocities is left out, so
+ * it is free to change; a difference there shows up in play soon enough. */
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* FNV-1a */
+static uint64_t digest_add(uint64_t h, const void *p, size_t n)
+{
+    const uint8_t *b = p;
+    while (n--)
+        h = (h ^ *b++) * 0x100000001B3ull;
+    return h;
+}
+
+static uint64_t digest_pieces(uint64_t h, const struct Piece *p, uint32_t n)
+{
+    uint32_t i;
+    for (i = 0; i < n; i++) {
+        if (!p[i].alive)
+            continue;
+        h = digest_add(h, &i, sizeof(i));
+        h = digest_add(h, &p[i].x, sizeof(p[i].x));
+        h = digest_add(h, &p[i].y, sizeof(p[i].y));
+        h = digest_add(h, &p[i].hp, sizeof(p[i].hp));
+    }
+    return h;
+}
+
+static uint64_t digest_state(void)
+{
+    uint64_t h = 0xCBF29CE484222325ull;
+    uint32_t y;
+    uint8_t over = game_over, pause = paused;
+
+    h = digest_add(h, &score, sizeof(score));
+    h = digest_add(h, &level, sizeof(level));
+    h = digest_add(h, &over, sizeof(over));
+    h = digest_add(h, &pause, sizeof(pause));
+    h = digest_add(h, &seed, sizeof(seed));
+    h = digest_add(h, &player.x, sizeof(player.x));
+    h = digest_pieces(h, enemy, N_ENEMYS);
+    h = digest_pieces(h, laser, N_LASERS);
+    for (y = 0; y < WELL_HEIGHT; y++)
+        h = digest_add(h, WELL_ROW(y), WELL_WIDTH);
+    return h;
+}
+
+/* Run one iteration of step(), and return 0 if it only counted down, 1 if
+ * it also spawned an enemy or advanced the pieces, and 2 if that moved or
+ * spawned something, which the kernel redraws. */
+static int digest_step(void)
+{
+    int ticked = !cont_enemyspawn || !cont_tick;
+    if (step())
+        return 2;
+    return ticked;
+}
+
+/* Redraw the whole screen, which the caller has mapped at 0xB8000, and digest
+ * it. */
+static uint64_t digest_screen(void)
+{
+    clear(BLACK);
+    draw();
+    return digest_add(0xCBF29CE484222325ull, video, ROWS * COLS * sizeof(*video));
+}
+
+static void dump_pieces(FILE *f, const char *name, const struct Piece *p,
+                        uint32_t n)
+{
+    uint32_t i;
+    fprintf(f, "%s:", name);
+    for (i = 0; i < n; i++)
+        if (p[i].alive)
+            fprintf(f, " %u@%d,%d/%u", i, p[i].x, p[i].y, p[i].hp);
+    fprintf(f, "\n");
+}
+
+/* Write the state and the screen last drawn to f. */
+static void dump_state(FILE *f)
+{
+    uint32_t x, y;
+
+    fprintf(f, "score %u level %u game_over %d paused %d seed %08x player x %d\n",
+            score, level, game_over, paused, seed, player.x);
+    dump_pieces(f, "enemys", enemy, N_ENEMYS);
+    dump_pieces(f, "lasers", laser, N_LASERS);
+    for (y = 0; y < ROWS; y++) {
+        for (x = 0; x < COLS; x++) {
+            uint8_t c = video[y * COLS + x] & 0xFF;
+            fputc(c >= 0x20 && c < 0x7F ? c : '?', f);
+        }
+        fputc('\n', f);
+    }
+}
+
+#endif
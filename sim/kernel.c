@@ -0,0 +1,163 @@
+/* Names lead.c shares with the C library are renamed, and nothing that
+ * touches hardware is ever called. */
+
+#define main   lead_main
+#define putc   lead_putc
+#define puts   lead_puts
+#define memcpy lead_memcpy
+#define memset lead_memset
+#define rand   lead_rand
+#define srand  lead_srand
+#define pow    lead_pow
+#include "../lead.c"
+#undef main
+#undef putc
+#undef puts
+#undef memcpy
+#undef memset
+#undef rand
+#undef srand
+#undef pow
+
+#include <string.h>
+
+#include "kernel.h"
+#include "digest.h"
+
+static struct State games[KERNEL_GAMES];
+
+/* Pausing is left out of struct State, so it is kept here for each game. */
+static bool games_paused[KERNEL_GAMES];
+
+/* The game in the globals, which games[] is out of date for, or -1. Games are
+ * only swapped when another is played, so that a game can be played a step
+ * at a time. */
+static int32_t loaded = -1;
+
+/* Save the game in the globals back into games[]. */
+static void unload(void)
+{
+    if (loaded < 0)
+        return;
+    save_state(&games[loaded]);
+    games_paused[loaded] = paused;
+    loaded = -1;
+}
+
+/* Put game k in the globals. */
+static void use(uint32_t k)
+{
+    if (loaded == (int32_t) k)
+        return;
+    unload();
+    load_state(&games[k]);
+    paused = games_paused[k];
+    loaded = k;
+}
+
+void kernel_reset(uint32_t k, uint32_t seed, uint32_t l)
+{
+    unload();
+    /* The globals as lead.c boots with them, then the title screen's setup */
+    score = 0;
+    game_over = false;
+    paused = false;
+    sprite_init();
+    lead_srand(seed);
+    next_level(l);
+    save_state(&games[k]);
+    games_paused[k] = false;
+    loaded = k;
+}
+
+void kernel_frame(uint32_t k, uint8_t action, uint32_t steps)
+{
+    use(k);
+    switch (action) {
+    case LEADSIM_LEFT:
+        move(-1);
+        break;
+    case LEADSIM_RIGHT:
+        move(1);
+        break;
+    case LEADSIM_FIRE:
+        spawn_playerlaser();
+        break;
+    }
+    while (steps--)
+        step();
+    update();
+}
+
+static void piece(const struct Piece *p, struct leadsim_piece *out)
+{
+    out->i = p->i;
+    out->hp = p->hp;
+    out->dmg = p->dmg;
+    out->alive = p->alive;
+    out->x = p->x;
+    out->y = p->y;
+    out->fx = p->fx;
+    out->fy = p->fy;
+    out->vx = p->vx;
+    out->vy = p->vy;
+}
+
+void kernel_get(uint32_t k, struct leadsim_game *out)
+{
+    const struct State *s = &games[k];
+    u32 i;
+
+    if (loaded == (int32_t) k)
+        unload();
+    for (i = 0; i < N_ENEMYS; i++)
+        piece(&s->enemy[i], &out->enemy[i]);
+    for (i = 0; i < N_LASERS; i++)
+        piece(&s->laser[i], &out->laser[i]);
+    piece(&s->player, &out->player);
+    out->score = s->score;
+    out->level = s->level;
+    out->game_over = s->game_over;
+    out->wallmove = s->wallmove;
+    out->enemyspawn = s->enemyspawn;
+    out->enemymove = s->enemymove;
+    out->cont_enemyspawn = s->cont_enemyspawn;
+    out->cont_tick = s->cont_tick;
+    out->enemy_vy = s->enemy_vy;
+    out->well_vy = s->well_vy;
+    out->well_fy = s->well_fy;
+    memcpy(out->well, s->well, sizeof(out->well));
+    memcpy(out->flow, s->flow, sizeof(out->flow));
+    out->well_top = s->well_top;
+    out->corridor_x = s->corridor_x;
+    out->corridor_w = s->corridor_w;
+    out->corridor_dir = s->corridor_dir;
+    out->corridor_run = s->corridor_run;
+    out->seed = s->seed;
+}
+
+int kernel_step(uint32_t k)
+{
+    use(k);
+    return digest_step();
+}
+
+void kernel_apply(uint32_t k, uint8_t e)
+{
+    use(k);
+    replay_apply(e);
+}
+
+void kernel_digest(uint32_t k, uint64_t *state, uint64_t *screen)
+{
+    use(k);
+    *state = digest_state();
+    if (screen)
+        *screen = digest_screen();
+}
+
+void kernel_dump(uint32_t k, FILE *f)
+{
+    use(k);
+    dump_state(f);
+}
@@ -0,0 +1,38 @@
+#ifndef KERNEL_H
+#define KERNEL_H
+
+/* The single-game kernel from lead.c, built for the host. It keeps a handful
+ * of games, swapping each in and out of lead.c's globals as it is played. */
+
+#include <stdio.h>
+
+#include "leadsim.h"
+
+#define KERNEL_GAMES (64)
+
+void kernel_reset(uint32_t k, uint32_t seed, uint32_t level);
+
+/* Play one frame of game k the way the batch does: apply action, run steps
+ * iterations of step() and then update(). */
+void kernel_frame(uint32_t k, uint8_t action, uint32_t steps);
+
+void kernel_get(uint32_t k, struct leadsim_game *out);
+
+/* Run one iteration of step() on game k, and return what it did: 0 if it
+ * only counted down, 1 if it also spawned an enemy or advanced the pieces,
+ * which may change the state, and 2 if that moved or spawned something, after
+ * which the kernel redraws the screen. */
+int kernel_step(uint32_t k);
+
+/* Apply replay event e to game k. */
+void kernel_apply(uint32_t k, uint8_t e);
+
+/* Digest the state and, unless screen is NULL, the screen of game k, as
+ * sim/digest.h does. The screen is redrawn at 0xB8000, which the caller must
+ * have mapped. */
+void kernel_digest(uint32_t k, uint64_t *state, uint64_t *screen);
+
+/* Write the state of game k and the screen last drawn to f. */
+void kernel_dump(uint32_t k, FILE *f);
+
+#endif
@@ -0,0 +1,855 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "leadsim.h"
+
+/* Games are stored in rows of this many, so that every pool slot starts on a
+ * cache line and threads never share one. */
+#define LANES (64)
+
+/* Most worker threads a batch will start */
+#define MAX_THREADS (256)
+
+/* One field of a piece per game, with one row of games per pool slot */
+struct pool {
+    uint32_t *i, *hp, *dmg;
+    uint8_t *alive;
+    int8_t *x, *y;
+    uint16_t *fx, *fy;
+    int32_t *vx, *vy;
+};
+
+enum op {
+    OP_STEP,
+    OP_UPDATE,
+    OP_INPUT,
+    OP_QUIT
+};
+
+struct worker {
+    struct leadsim *s;
+    pthread_t thread;
+    uint32_t g0, g1;
+    uint8_t *m, *act, *pend;
+};
+
+struct leadsim {
+    uint32_t n, stride;
+
+    struct pool enemy, laser, player;
+    uint32_t *score, *level;
+    uint8_t *game_over;
+    uint32_t *wallmove, *enemyspawn, *enemymove;
+    uint32_t *cont_enemyspawn, *cont_tick;
+    int32_t *enemy_vy, *well_vy;
+    uint32_t *well_fy;
+    uint8_t *well; /* One row of games per cell, WELL_WIDTH cells per row */
+    uint8_t *flow; /* Laid out as well */
+    uint8_t *well_top, *corridor_x, *corridor_w, *corridor_run;
+    int8_t *corridor_dir;
+    uint32_t *seed;
+
+    /* Thread pool: workers[0] is the calling thread. */
+    struct worker workers[MAX_THREADS];
+    uint32_t threads;
+    pthread_mutex_t lock;
+    pthread_cond_t go, done;
+    uint32_t gen, pending;
+    enum op op;
+    uint32_t steps;
+    uint8_t *actions;
+
+    void *allocs[64];
+    uint32_t nallocs;
+    int failed;
+};
+
+/* Row of slot in a pool field */
+#define AT(p, slot) ((p) + (size_t) (slot) * s->stride)
+
+/* Cell x of row y of the well ring of game g */
+#define CELL(g, y, x) (AT(s->well, (y) * WELL_WIDTH + (x))[g])
+
+/* The same cell of the flow ring */
+#define FLOW(g, y, x) (AT(s->flow, (y) * WELL_WIDTH + (x))[g])
+
+/* Screen column of the well's first cell, as in lead.c */
+#define WELL_X (2)
+
+/* Fixed-point positions and velocities, as in lead.c */
+#define FIX_SHIFT (16)
+#define FIX_ONE   (1 << FIX_SHIFT)
+#define FIX_MASK  (FIX_ONE - 1)
+#define FIX_VELOCITY(period) ((int32_t) (FIX_ONE * (uint32_t) TICK / (period)))
+#define LASER_VY  (-FIX_ONE)
+
+/* Allocation */
+
+static void *field(struct leadsim *s, size_t size, uint32_t rows)
+{
+    size_t bytes = (size * rows * s->stride + 63) & ~(size_t) 63;
+    void *p = aligned_alloc(64, bytes);
+    if (!p || s->nallocs == sizeof(s->allocs) / sizeof(s->allocs[0])) {
+        free(p);
+        s->failed = 1;
+        return NULL;
+    }
+    memset(p, 0, bytes);
+    return s->allocs[s->nallocs++] = p;
+}
+
+static void pool_new(struct leadsim *s, struct pool *p, uint32_t rows)
+{
+    p->i = field(s, sizeof(uint32_t), rows);
+    p->hp = field(s, sizeof(uint32_t), rows);
+    p->dmg = field(s, sizeof(uint32_t), rows);
+    p->alive = field(s, sizeof(uint8_t), rows);
+    p->x = field(s, sizeof(int8_t), rows);
+    p->y = field(s, sizeof(int8_t), rows);
+    p->fx = field(s, sizeof(uint16_t), rows);
+    p->fy = field(s, sizeof(uint16_t), rows);
+    p->vx = field(s, sizeof(int32_t), rows);
+    p->vy = field(s, sizeof(int32_t), rows);
+}
+
+static void pool_get(const struct leadsim *s, const struct pool *p,
+                     uint32_t slot, uint32_t g, struct leadsim_piece *out)
+{
+    out->i = AT(p->i, slot)[g];
+    out->hp = AT(p->hp, slot)[g];
+    out->dmg = AT(p->dmg, slot)[g];
+    out->alive = AT(p->alive, slot)[g];
+    out->x = AT(p->x, slot)[g];
+    out->y = AT(p->y, slot)[g];
+    out->fx = AT(p->fx, slot)[g];
+    out->fy = AT(p->fy, slot)[g];
+    out->vx = AT(p->vx, slot)[g];
+    out->vy = AT(p->vy, slot)[g];
+}
+
+static void pool_set(struct leadsim *s, struct pool *p, uint32_t slot,
+                     uint32_t g, uint32_t i, uint32_t hp, uint32_t dmg,
+                     int8_t x, int8_t y)
+{
+    AT(p->i, slot)[g] = i;
+    AT(p->hp, slot)[g] = hp;
+    AT(p->dmg, slot)[g] = dmg;
+    AT(p->alive, slot)[g] = 0;
+    AT(p->x, slot)[g] = x;
+    AT(p->y, slot)[g] = y;
+    AT(p->fx, slot)[g] = 0;
+    AT(p->fy, slot)[g] = 0;
+    AT(p->vx, slot)[g] = 0;
+    AT(p->vy, slot)[g] = 0;
+}
+
+/* Per-game rules
+ *
+ * Level changes, enemy spawns and scrolls of the well are rare, and the
+ * latter two draw from each game's own generator, so they run one game at a
+ * time. */
+
+/* next_level() for game g */
+static void next_level(struct leadsim *s, uint32_t g, uint32_t l)
+{
+    uint32_t i;
+
+    s->level[g] = l;
+    switch (l) {
+    case 1:
+        s->enemyspawn[g] = ENEMYSPAWN;
+        s->enemymove[g] = ENEMYMOVE;
+        s->wallmove[g] = WALLMOVE;
+        s->corridor_w[g] = WELL_WIDTH/2 - 1;
+        break;
+    case 2:
+        s->enemyspawn[g] = ENEMYSPAWN * 2;
+        s->enemymove[g] = ENEMYMOVE;
+        s->wallmove[g] = WALLMOVE;
+        s->corridor_w[g] = WELL_WIDTH/2 - WELL_WIDTH/8 - 1;
+        break;
+    case 3:
+        s->enemyspawn[g] = ENEMYSPAWN * 1.5;
+        s->enemymove[g] = ENEMYMOVE;
+        s->wallmove[g] = WALLMOVE;
+        s->corridor_w[g] = WELL_WIDTH/2 - WELL_WIDTH/8 - 1;
+        break;
+    case 4:
+        s->enemyspawn[g] = ENEMYSPAWN * 1.5;
+        s->enemymove[g] = ENEMYMOVE * 2;
+        s->wallmove[g] = s->enemymove[g];
+        s->corridor_w[g] = WELL_WIDTH/4 - 1;
+        break;
+    }
+    s->cont_enemyspawn[g] = s->enemyspawn[g];
+    s->cont_tick[g] = TICK - 1;
+    s->enemy_vy[g] = FIX_VELOCITY(s->enemymove[g]);
+    s->well_vy[g] = FIX_VELOCITY(s->wallmove[g]);
+    s->well_fy[g] = 0;
+
+    for (i = 0; i < WELL_HEIGHT * WELL_WIDTH; i++) {
+        AT(s->well, i)[g] = 0;
+        AT(s->flow, i)[g] = FLOW_DEPTH;
+    }
+    s->well_top[g] = 0;
+    s->corridor_x[g] = (WELL_WIDTH - s->corridor_w[g]) / 2;
+    s->corridor_dir[g] = 0;
+    s->corridor_run[g] = 0;
+
+    if (l >= 1 && l <= 4)
+        for (i = 0; i < N_ENEMYS; i++)
+            pool_set(s, &s->enemy, i, g, l, l == 1 || l == 3 ? 3 : 999, 1,
+                     0, 0);
+    for (i = 0; i < N_LASERS; i++)
+        pool_set(s, &s->laser, i, g, 1, 999, 1, 0, 0);
+    pool_set(s, &s->player, 0, g, 1, 1, 0, WELL_WIDTH + 1, WELL_HEIGHT - 1);
+}
+
+/* The level checks of increase_score() for game g, whose score has already
+ * been increased. */
+static void level_up(struct leadsim *s, uint32_t g)
+{
+    uint32_t score = s->score[g];
+    if (score >= SCORE_LEVEL && score < 2 * SCORE_LEVEL && s->level[g] < 2)
+        next_level(s, g, 2);
+    if (score >= 2 * SCORE_LEVEL && score < 3 * SCORE_LEVEL && s->level[g] < 3)
+        next_level(s, g, 3);
+    if (score >= 3 * SCORE_LEVEL && s->level[g] < 4)
+        next_level(s, g, 4);
+}
+
+/* rand() for game g */
+static uint32_t rand_range(struct leadsim *s, uint32_t g, uint32_t range)
+{
+    uint32_t x = s->seed[g];
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    s->seed[g] = x;
+    return x % range;
+}
+
+/* corridor_row() for game g, into the top row of its well */
+static void corridor_row(struct leadsim *s, uint32_t g)
+{
+    uint32_t x, y = s->well_top[g], cx, cw = s->corridor_w[g];
+    uint8_t level = (uint8_t) s->level[g];
+
+    if (level > 1) {
+        if (!s->corridor_run[g]) {
+            s->corridor_run[g] = rand_range(s, g, CORRIDOR_RUN) + 1;
+            s->corridor_dir[g] = (int8_t) rand_range(s, g, 3) - 1;
+        }
+        s->corridor_run[g]--;
+        if (s->corridor_run[g] & 1) {
+            int d = s->corridor_dir[g];
+            if (s->corridor_x[g] + d < 1
+                    || s->corridor_x[g] + cw + d > WELL_WIDTH - 1)
+                s->corridor_dir[g] = (int8_t) -d;
+            s->corridor_x[g] += s->corridor_dir[g];
+        }
+    }
+    cx = s->corridor_x[g];
+    for (x = 0; x < WELL_WIDTH; x++)
+        CELL(g, y, x) = x < cx || x >= cx + cw ? level : 0;
+}
+
+/* flow_row() for game g */
+static void flow_row(struct leadsim *s, uint32_t g)
+{
+    uint32_t x, y, r, d;
+
+    for (x = 0; x < WELL_WIDTH; x++) {
+        d = FLOW_DEPTH;
+        for (y = 0; y < WELL_HEIGHT; y++) {
+            r = (s->well_top[g] + y) % WELL_HEIGHT;
+            d = CELL(g, r, x) ? 0 : d < FLOW_DEPTH ? d + 1 : FLOW_DEPTH;
+            if (y && FLOW(g, r, x) == d)
+                break;
+            FLOW(g, r, x) = (uint8_t) d;
+        }
+    }
+}
+
+/* terrain_hit() for game g */
+static int terrain_hit(const struct leadsim *s, uint32_t g, int x, int y)
+{
+    uint32_t r = (s->well_top[g] + y) % WELL_HEIGHT;
+    if (x < WELL_X || x + 1 >= WELL_X + WELL_WIDTH * 2)
+        return 1;
+    return CELL(g, r, (x - WELL_X) / 2) || CELL(g, r, (x + 1 - WELL_X) / 2);
+}
+
+/* clearance() for game g, in row r of its flow ring */
+static uint32_t clearance(const struct leadsim *s, uint32_t g, uint32_t r,
+                          int x)
+{
+    uint32_t a, b;
+    if (x < WELL_X || x + 1 >= WELL_X + WELL_WIDTH * 2)
+        return 0;
+    a = FLOW(g, r, (x - WELL_X) / 2);
+    b = FLOW(g, r, (x + 1 - WELL_X) / 2);
+    return a < b ? a : b;
+}
+
+/* steer_enemy() for enemy i of game g */
+static void steer_enemy(struct leadsim *s, uint32_t g, uint32_t i)
+{
+    int x = AT(s->enemy.x, i)[g];
+    int px = AT(s->player.x, 0)[g], order[3], k, best = 0;
+    uint32_t r, c, most = 0;
+
+    if (!AT(s->enemy.alive, i)[g])
+        return;
+    r = (s->well_top[g] + AT(s->enemy.y, i)[g]) % WELL_HEIGHT;
+    order[0] = px < x ? -1 : px > x;
+    order[1] = order[0] ? 0 : -1;
+    order[2] = order[0] ? -order[0] : 1;
+    for (k = 0; k < 3; k++) {
+        c = clearance(s, g, r, x + order[k]);
+        if (c > most) {
+            most = c;
+            best = order[k];
+        }
+    }
+    AT(s->enemy.vx, i)[g] = best * AT(s->enemy.vy, i)[g];
+}
+
+/* push_enemy() for enemy i of game g */
+static void push_enemy(struct leadsim *s, uint32_t g, uint32_t i)
+{
+    int8_t *x = &AT(s->enemy.x, i)[g];
+    int d, y = AT(s->enemy.y, i)[g];
+    if (!AT(s->enemy.alive, i)[g])
+        return;
+    for (d = 1; d < WELL_WIDTH * 2 && terrain_hit(s, g, *x, y); d++)
+        *x += d & 1 ? d : -d;
+}
+
+/* move_walls() for game g, which is not over */
+static void move_walls(struct leadsim *s, uint32_t g)
+{
+    uint32_t i;
+    s->well_top[g] = (s->well_top[g] + WELL_HEIGHT - 1) % WELL_HEIGHT;
+    corridor_row(s, g);
+    flow_row(s, g);
+    for (i = 0; i < N_ENEMYS; i++)
+        push_enemy(s, g, i);
+    if (terrain_hit(s, g, AT(s->player.x, 0)[g], WELL_HEIGHT - 1))
+        s->game_over[g] = 1;
+}
+
+/* spawn_enemy() for game g */
+static void spawn_enemy(struct leadsim *s, uint32_t g)
+{
+    uint32_t i, r, level = s->level[g];
+
+    r = rand_range(s, g, s->corridor_w[g] * 2 - 1) + WELL_X
+        + s->corridor_x[g] * 2;
+    for (i = 0; i < N_ENEMYS; i++) {
+        if (!AT(s->enemy.alive, i)[g]) {
+            AT(s->enemy.alive, i)[g] = 1;
+            AT(s->enemy.x, i)[g] = (int8_t) r;
+            AT(s->enemy.y, i)[g] = 2;
+            AT(s->enemy.fx, i)[g] = 0;
+            AT(s->enemy.fy, i)[g] = 0;
+            AT(s->enemy.vx, i)[g] = 0;
+            AT(s->enemy.vy, i)[g] = s->enemy_vy[g];
+            if (level >= 1 && level <= 4) {
+                AT(s->enemy.hp, i)[g] = level == 1 || level == 3 ? 2 : 999;
+                AT(s->enemy.dmg, i)[g] = 1;
+            }
+            push_enemy(s, g, i);
+            steer_enemy(s, g, i);
+            break;
+        }
+    }
+}
+
+/* Batch kernels
+ *
+ * Each runs one rule over games [g0, g1) as straight-line loops over games, so
+ * that the compiler can vectorize them. m holds a 0/1 mask of the games the
+ * rule applies to; where the single-game kernel would return early or skip a
+ * piece, the mask is cleared instead. */
+
+/* Count down one of the cadence counters, setting m for games where it was due
+ * and reloading it from reload. Return non-zero if any game was due. */
+static uint32_t k_count(uint32_t *restrict cont, const uint32_t *restrict reload,
+                        const uint8_t *restrict game_over, uint8_t *restrict m,
+                        uint32_t g0, uint32_t g1)
+{
+    uint32_t g, any = 0;
+    for (g = g0; g < g1; g++) {
+        uint32_t due = cont[g] == 0;
+        cont[g] = due ? reload[g] : cont[g] - 1;
+        m[g] = due & !game_over[g];
+        any |= m[g];
+    }
+    return any;
+}
+
+/* Count down the tick counter, setting m for games where a tick was due.
+ * Return non-zero if any game was due. */
+static uint32_t k_tick(uint32_t *restrict cont,
+                       const uint8_t *restrict game_over, uint8_t *restrict m,
+                       uint32_t g0, uint32_t g1)
+{
+    uint32_t g, any = 0;
+    for (g = g0; g < g1; g++) {
+        uint32_t due = cont[g] == 0;
+        cont[g] = due ? TICK - 1 : cont[g] - 1;
+        m[g] = due & !game_over[g];
+        any |= m[g];
+    }
+    return any;
+}
+
+/* The scroll of the well in advance() */
+static void k_advance_well(struct leadsim *s, uint32_t g0, uint32_t g1,
+                           uint8_t *restrict m)
+{
+    uint32_t *restrict fy = s->well_fy;
+    const int32_t *restrict vy = s->well_vy;
+    uint32_t g, any = 0;
+
+    for (g = g0; g < g1; g++) {
+        fy[g] += m[g] ? vy[g] : 0;
+        any |= m[g] & (fy[g] >= FIX_ONE);
+    }
+    if (any)
+        for (g = g0; g < g1; g++)
+            for (; m[g] && fy[g] >= FIX_ONE; fy[g] -= FIX_ONE)
+                if (!s->game_over[g])
+                    move_walls(s, g);
+    for (g = g0; g < g1; g++)
+        m[g] &= !s->game_over[g];
+}
+
+/* move_enemys() */
+static void k_move_enemys(struct leadsim *s, uint32_t g0, uint32_t g1,
+                          const uint8_t *restrict m, uint8_t *restrict act,
+                          uint8_t *restrict up)
+{
+    const int8_t *restrict px = s->player.x;
+    uint8_t *restrict game_over = s->game_over;
+    uint32_t *restrict score = s->score;
+    const uint32_t *restrict level = s->level;
+    uint32_t g, i;
+
+    for (i = 0; i < N_ENEMYS; i++) {
+        uint8_t *restrict alive = AT(s->enemy.alive, i);
+        int8_t *restrict ex = AT(s->enemy.x, i), *restrict ey = AT(s->enemy.y, i);
+        uint16_t *restrict efx = AT(s->enemy.fx, i), *restrict efy = AT(s->enemy.fy, i);
+        const int32_t *restrict evx = AT(s->enemy.vx, i), *restrict evy = AT(s->enemy.vy, i);
+        uint32_t ups = 0, any = 0;
+
+        for (g = g0; g < g1; g++) {
+            uint32_t a = m[g] & alive[g] & (ey[g] < WELL_HEIGHT);
+            int32_t fx = efx[g] + (a ? evx[g] : 0);
+            int32_t fy = efy[g] + (a ? evy[g] : 0);
+            int8_t dx = (int8_t) (fx >> FIX_SHIFT), dy = (int8_t) (fy >> FIX_SHIFT);
+            uint32_t moved = (dx != 0) | (dy != 0);
+            int8_t y = ey[g] + dy;
+            uint32_t gone = moved & (y >= WELL_HEIGHT);
+            uint32_t scored = gone & ((level[g] == 2) | (level[g] == 4));
+            efx[g] = (uint16_t) (fx & FIX_MASK);
+            efy[g] = (uint16_t) (fy & FIX_MASK);
+            ex[g] += dx;
+            ey[g] = y;
+            alive[g] &= !gone;
+            score[g] += scored * SCORE_DODGE;
+            act[g] = moved & !gone;
+            up[g] = scored & (score[g] >= SCORE_LEVEL) & (level[g] < 4);
+            any |= act[g];
+            ups |= up[g];
+        }
+        /* Enemys that moved into a wall are pushed out and steered before the
+         * player is checked, and a game that levels up has no enemy left to
+         * check. */
+        if (any) {
+            for (g = g0; g < g1; g++) {
+                if (act[g]) {
+                    push_enemy(s, g, i);
+                    steer_enemy(s, g, i);
+                }
+            }
+            for (g = g0; g < g1; g++)
+                game_over[g] |= act[g] & (ey[g] == WELL_HEIGHT - 1)
+                    & ((ex[g] == px[g]) | (ex[g] == px[g] + 1) | (ex[g] + 1 == px[g]));
+        }
+        if (ups)
+            for (g = g0; g < g1; g++)
+                if (up[g])
+                    level_up(s, g);
+    }
+}
+
+/* move_playerlasers() */
+static void k_move_playerlasers(struct leadsim *s, uint32_t g0, uint32_t g1,
+                                const uint8_t *restrict m, uint8_t *restrict act,
+                                uint8_t *restrict up)
+{
+    uint32_t *restrict score = s->score;
+    const uint32_t *restrict level = s->level;
+    uint32_t g, i, j;
+
+    for (i = 0; i < N_LASERS; i++) {
+        uint8_t *restrict lalive = AT(s->laser.alive, i);
+        const uint32_t *restrict dmg = AT(s->laser.dmg, i);
+        int8_t *restrict lx = AT(s->laser.x, i), *restrict ly = AT(s->laser.y, i);
+        uint16_t *restrict lfx = AT(s->laser.fx, i), *restrict lfy = AT(s->laser.fy, i);
+        const int32_t *restrict lvx = AT(s->laser.vx, i), *restrict lvy = AT(s->laser.vy, i);
+        uint32_t any = 0;
+
+        for (g = g0; g < g1; g++) {
+            uint32_t a = m[g] & lalive[g] & (ly[g] > 1);
+            int32_t fx = lfx[g] + (a ? lvx[g] : 0);
+            int32_t fy = lfy[g] + (a ? lvy[g] : 0);
+            int8_t dx = (int8_t) (fx >> FIX_SHIFT), dy = (int8_t) (fy >> FIX_SHIFT);
+            lfx[g] = (uint16_t) (fx & FIX_MASK);
+            lfy[g] = (uint16_t) (fy & FIX_MASK);
+            lx[g] += dx;
+            ly[g] += dy;
+            act[g] = (dx != 0) | (dy != 0);
+            lalive[g] &= !(act[g] & (ly[g] <= 1));
+            any |= act[g];
+        }
+        if (!any)
+            continue;
+
+        for (j = 0; j < N_ENEMYS; j++) {
+            uint8_t *restrict ealive = AT(s->enemy.alive, j);
+            uint32_t *restrict hp = AT(s->enemy.hp, j);
+            const int8_t *restrict ex = AT(s->enemy.x, j);
+            const int8_t *restrict ey = AT(s->enemy.y, j);
+            uint32_t ups = 0;
+
+            for (g = g0; g < g1; g++) {
+                uint32_t hit = act[g] & ealive[g] & (ly[g] == ey[g])
+                    & ((lx[g] == ex[g]) | (lx[g] == ex[g] + 1) | (lx[g] + 1 == ex[g]));
+                uint32_t h = hp[g] - (hit ? dmg[g] : 0);
+                uint32_t kill = hit & (h == 0);
+                hp[g] = h;
+                lalive[g] &= !hit;
+                score[g] += kill * SCORE_KILL;
+                ealive[g] &= !kill;
+                up[g] = kill & (score[g] >= SCORE_LEVEL) & (level[g] < 4);
+                ups |= up[g];
+            }
+            if (ups)
+                for (g = g0; g < g1; g++)
+                    if (up[g])
+                        level_up(s, g);
+        }
+    }
+}
+
+/* move() and spawn_playerlaser() */
+static void k_input(struct leadsim *s, uint32_t g0, uint32_t g1,
+                    const uint8_t *restrict actions, uint8_t *restrict pend)
+{
+    uint8_t *restrict game_over = s->game_over;
+    int8_t *restrict px = s->player.x;
+    uint32_t g, i, left = 0;
+
+    for (g = g0; g < g1; g++) {
+        uint32_t on = !game_over[g];
+        uint32_t l = on & (actions[g] == LEADSIM_LEFT) & (2 < px[g]);
+        uint32_t r = on & (actions[g] == LEADSIM_RIGHT) & (px[g] < WELL_WIDTH*2);
+        px[g] += r - l;
+        pend[g] = on & (actions[g] == LEADSIM_FIRE);
+        left |= pend[g];
+    }
+    for (g = g0; g < g1; g++)
+        if (!game_over[g] && (actions[g] == LEADSIM_LEFT
+                              || actions[g] == LEADSIM_RIGHT))
+            game_over[g] = terrain_hit(s, g, px[g], WELL_HEIGHT - 1);
+    for (i = 0; i < N_LASERS && left; i++) {
+        uint8_t *restrict alive = AT(s->laser.alive, i);
+        int8_t *restrict x = AT(s->laser.x, i), *restrict y = AT(s->laser.y, i);
+        uint16_t *restrict fx = AT(s->laser.fx, i), *restrict fy = AT(s->laser.fy, i);
+        int32_t *restrict vx = AT(s->laser.vx, i), *restrict vy = AT(s->laser.vy, i);
+        left = 0;
+        for (g = g0; g < g1; g++) {
+            uint8_t take = pend[g] & !alive[g];
+            alive[g] |= take;
+            x[g] = take ? px[g] : x[g];
+            y[g] = take ? WELL_HEIGHT - 2 : y[g];
+            fx[g] = take ? 0 : fx[g];
+            fy[g] = take ? 0 : fy[g];
+            vx[g] = take ? 0 : vx[g];
+            vy[g] = take ? LASER_VY : vy[g];
+            pend[g] &= !take;
+            left |= pend[g];
+        }
+    }
+}
+
+/* step() */
+static void k_step(struct leadsim *s, struct worker *w)
+{
+    uint32_t g, g0 = w->g0, g1 = w->g1;
+
+    if (k_count(s->cont_enemyspawn, s->enemyspawn, s->game_over, w->m, g0, g1))
+        for (g = g0; g < g1; g++)
+            if (w->m[g])
+                spawn_enemy(s, g);
+    if (k_tick(s->cont_tick, s->game_over, w->m, g0, g1)) {
+        k_advance_well(s, g0, g1, w->m);
+        k_move_enemys(s, g0, g1, w->m, w->act, w->pend);
+    }
+}
+
+/* update() */
+static void k_update(struct leadsim *s, struct worker *w)
+{
+    uint32_t g;
+    for (g = w->g0; g < w->g1; g++)
+        w->m[g] = !s->game_over[g];
+    k_move_playerlasers(s, w->g0, w->g1, w->m, w->act, w->pend);
+}
+
+/* Thread pool */
+
+static void run_chunk(struct leadsim *s, struct worker *w)
+{
+    uint32_t t;
+    switch (s->op) {
+    case OP_STEP:
+        for (t = 0; t < s->steps; t++)
+            k_step(s, w);
+        break;
+    case OP_UPDATE:
+        k_update(s, w);
+        break;
+    case OP_INPUT:
+        k_input(s, w->g0, w->g1, s->actions, w->pend);
+        break;
+    case OP_QUIT:
+        break;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct leadsim *s = w->s;
+    uint32_t gen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        while (s->gen == gen)
+            pthread_cond_wait(&s->go, &s->lock);
+        gen = s->gen;
+        pthread_mutex_unlock(&s->lock);
+        if (s->op == OP_QUIT)
+            return NULL;
+        run_chunk(s, w);
+        pthread_mutex_lock(&s->lock);
+        if (--s->pending == 0)
+            pthread_cond_signal(&s->done);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/* Run op on every chunk of games, the first on the calling thread, and wait
+ * for all of them to finish. Games never interact, so a whole call runs
+ * without any synchronisation between threads. */
+static void run(struct leadsim *s, enum op op)
+{
+    pthread_mutex_lock(&s->lock);
+    s->op = op;
+    s->pending = s->threads - 1;
+    s->gen++;
+    pthread_cond_broadcast(&s->go);
+    pthread_mutex_unlock(&s->lock);
+
+    if (op == OP_QUIT)
+        return;
+    run_chunk(s, &s->workers[0]);
+
+    pthread_mutex_lock(&s->lock);
+    while (s->pending)
+        pthread_cond_wait(&s->done, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Public interface */
+
+struct leadsim *leadsim_new(uint32_t games, uint32_t threads)
+{
+    struct leadsim *s = calloc(1, sizeof(*s));
+    uint32_t rows, t, per;
+
+    if (!s)
+        return NULL;
+    s->n = games;
+    s->stride = (games + LANES - 1) / LANES * LANES;
+    rows = s->stride / LANES;
+
+    pool_new(s, &s->enemy, N_ENEMYS);
+    pool_new(s, &s->laser, N_LASERS);
+    pool_new(s, &s->player, 1);
+    s->score = field(s, sizeof(uint32_t), 1);
+    s->level = field(s, sizeof(uint32_t), 1);
+    s->game_over = field(s, sizeof(uint8_t), 1);
+    s->wallmove = field(s, sizeof(uint32_t), 1);
+    s->enemyspawn = field(s, sizeof(uint32_t), 1);
+    s->enemymove = field(s, sizeof(uint32_t), 1);
+    s->cont_enemyspawn = field(s, sizeof(uint32_t), 1);
+    s->cont_tick = field(s, sizeof(uint32_t), 1);
+    s->enemy_vy = field(s, sizeof(int32_t), 1);
+    s->well_vy = field(s, sizeof(int32_t), 1);
+    s->well_fy = field(s, sizeof(uint32_t), 1);
+    s->well = field(s, sizeof(uint8_t), WELL_HEIGHT * WELL_WIDTH);
+    s->flow = field(s, sizeof(uint8_t), WELL_HEIGHT * WELL_WIDTH);
+    s->well_top = field(s, sizeof(uint8_t), 1);
+    s->corridor_x = field(s, sizeof(uint8_t), 1);
+    s->corridor_w = field(s, sizeof(uint8_t), 1);
+    s->corridor_dir = field(s, sizeof(int8_t), 1);
+    s->corridor_run = field(s, sizeof(uint8_t), 1);
+    s->seed = field(s, sizeof(uint32_t), 1);
+    s->actions = field(s, sizeof(uint8_t), 1);
+
+    if (!threads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (uint32_t) cpus : 1;
+    }
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    if (threads > rows)
+        threads = rows ? rows : 1;
+
+    /* Split the rows of games as evenly as possible. The masks are shared, as
+     * each worker only touches the part covering its own games. */
+    per = rows / threads;
+    for (t = 0; t < threads; t++) {
+        struct worker *w = &s->workers[t];
+        w->s = s;
+        w->g0 = (t * per + (t < rows % threads ? t : rows % threads)) * LANES;
+        w->g1 = w->g0 + (per + (t < rows % threads)) * LANES;
+    }
+    s->workers[0].m = field(s, sizeof(uint8_t), 1);
+    s->workers[0].act = field(s, sizeof(uint8_t), 1);
+    s->workers[0].pend = field(s, sizeof(uint8_t), 1);
+    for (t = 1; t < threads; t++) {
+        s->workers[t].m = s->workers[0].m;
+        s->workers[t].act = s->workers[0].act;
+        s->workers[t].pend = s->workers[0].pend;
+    }
+    /* s->threads stays 0 until the lock and the conditions are set up, so
+     * that leadsim_free() leaves them and the workers alone before then. */
+    if (s->failed) {
+        leadsim_free(s);
+        return NULL;
+    }
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->go, NULL);
+    pthread_cond_init(&s->done, NULL);
+    s->threads = threads;
+    for (t = 1; t < threads; t++) {
+        if (pthread_create(&s->workers[t].thread, NULL, worker_main,
+                           &s->workers[t])) {
+            s->threads = t;
+            break;
+        }
+    }
+    if (s->threads != threads) {
+        /* Fall back to the threads that did start, splitting evenly again. */
+        uint32_t started = s->threads;
+        run(s, OP_QUIT);
+        for (t = 1; t < started; t++)
+            pthread_join(s->workers[t].thread, NULL);
+        s->threads = 1;
+        s->workers[0].g0 = 0;
+        s->workers[0].g1 = s->stride;
+    }
+    return s;
+}
+
+void leadsim_free(struct leadsim *s)
+{
+    uint32_t t;
+    if (!s)
+        return;
+    if (s->threads > 1) {
+        run(s, OP_QUIT);
+        for (t = 1; t < s->threads; t++)
+            pthread_join(s->workers[t].thread, NULL);
+    }
+    if (s->threads) {
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->go);
+        pthread_cond_destroy(&s->done);
+    }
+    for (t = 0; t < s->nallocs; t++)
+        free(s->allocs[t]);
+    free(s);
+}
+
+void leadsim_reset(struct leadsim *s, const uint32_t *seeds, uint32_t level)
+{
+    uint32_t g;
+    for (g = 0; g < s->stride; g++) {
+        uint32_t seed = g < s->n ? seeds[g] : 1;
+        s->score[g] = 0;
+        s->game_over[g] = 0;
+        s->seed[g] = seed ? seed : 1;
+        next_level(s, g, level);
+    }
+}
+
+void leadsim_input(struct leadsim *s, const uint8_t *actions)
+{
+    /* Past n, the buffer stays zeroed (LEADSIM_STAY) for the padding games. */
+    memcpy(s->actions, actions, s->n);
+    run(s, OP_INPUT);
+}
+
+void leadsim_step(struct leadsim *s, uint32_t steps)
+{
+    s->steps = steps;
+    run(s, OP_STEP);
+}
+
+void leadsim_update(struct leadsim *s)
+{
+    run(s, OP_UPDATE);
+}
+
+void leadsim_get(const struct leadsim *s, uint32_t g, struct leadsim_game *out)
+{
+    uint32_t i;
+    for (i = 0; i < N_ENEMYS; i++)
+        pool_get(s, &s->enemy, i, g, &out->enemy[i]);
+    for (i = 0; i < N_LASERS; i++)
+        pool_get(s, &s->laser, i, g, &out->laser[i]);
+    pool_get(s, &s->player, 0, g, &out->player);
+    out->score = s->score[g];
+    out->level = s->level[g];
+    out->game_over = s->game_over[g];
+    out->wallmove = s->wallmove[g];
+    out->enemyspawn = s->enemyspawn[g];
+    out->enemymove = s->enemymove[g];
+    out->cont_enemyspawn = s->cont_enemyspawn[g];
+    out->cont_tick = s->cont_tick[g];
+    out->enemy_vy = s->enemy_vy[g];
+    out->well_vy = s->well_vy[g];
+    out->well_fy = s->well_fy[g];
+    for (i = 0; i < WELL_HEIGHT * WELL_WIDTH; i++)
+        out->well[i / WELL_WIDTH][i % WELL_WIDTH] = AT(s->well, i)[g];
+    for (i = 0; i < WELL_HEIGHT * WELL_WIDTH; i++)
+        out->flow[i / WELL_WIDTH][i % WELL_WIDTH] = AT(s->flow, i)[g];
+    out->well_top = s->well_top[g];
+    out->corridor_x = s->corridor_x[g];
+    out->corridor_w = s->corridor_w[g];
+    out->corridor_dir = s->corridor_dir[g];
+    out->corridor_run = s->corridor_run[g];
+    out->seed = s->seed[g];
+}
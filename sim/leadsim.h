@@ -0,0 +1,76 @@
+#ifndef LEADSIM_H
+#define LEADSIM_H
+
+/* Host-side build of the Lead rules that steps a batch of independent games at
+ * once. Each game follows exactly the rules of the single-game kernel in
+ * lead.c: given the same seed, level and inputs, a game in the batch ends up in
+ * the same state bit for bit. State is stored structure-of-arrays with the game
+ * as the innermost index, so every rule runs as a vector loop over games, and
+ * the batch is split across a pool of threads. */
+
+#include <stdint.h>
+
+#include "../config.h"
+
+/* Player inputs, as applied by the keyboard handler in lead.c */
+enum leadsim_action {
+    LEADSIM_STAY,
+    LEADSIM_LEFT,
+    LEADSIM_RIGHT,
+    LEADSIM_FIRE
+};
+
+struct leadsim_piece {
+    uint32_t i, hp, dmg;
+    uint8_t alive;
+    int8_t x, y;
+    uint16_t fx, fy;
+    int32_t vx, vy;
+};
+
+/* One game's state, in the same terms as struct State in lead.c */
+struct leadsim_game {
+    struct leadsim_piece enemy[N_ENEMYS];
+    struct leadsim_piece laser[N_LASERS];
+    struct leadsim_piece player;
+    uint32_t score, level;
+    uint8_t game_over;
+    uint32_t wallmove, enemyspawn, enemymove;
+    uint32_t cont_enemyspawn, cont_tick;
+    int32_t enemy_vy, well_vy;
+    uint32_t well_fy;
+    uint8_t well[WELL_HEIGHT][WELL_WIDTH];
+    uint8_t flow[WELL_HEIGHT][WELL_WIDTH];
+    uint8_t well_top, corridor_x, corridor_w;
+    int8_t corridor_dir;
+    uint8_t corridor_run;
+    uint32_t seed;
+};
+
+struct leadsim;
+
+/* Allocate a batch of games stepped by threads threads (0 for one per CPU).
+ * Return NULL on allocation failure. */
+struct leadsim *leadsim_new(uint32_t games, uint32_t threads);
+
+void leadsim_free(struct leadsim *s);
+
+/* Start every game over at level, game g seeded with seeds[g], as lead.c does
+ * when a key is pressed on the title screen. */
+void leadsim_reset(struct leadsim *s, const uint32_t *seeds, uint32_t level);
+
+/* Apply one enum leadsim_action per game, like a key press in lead.c. */
+void leadsim_input(struct leadsim *s, const uint8_t *actions);
+
+/* Run steps iterations of step() (spawning enemys, and advancing the enemys
+ * and the well by their velocities and steering the enemys every TICK steps)
+ * on every game. */
+void leadsim_step(struct leadsim *s, uint32_t steps);
+
+/* Run update() (moving the player's lasers) on every game. */
+void leadsim_update(struct leadsim *s);
+
+/* Copy out the state of game g. */
+void leadsim_get(const struct leadsim *s, uint32_t g, struct leadsim_game *out);
+
+#endif
@@ -0,0 +1,190 @@
+/* Play the current lead.c and the frozen reference engine side by side, from
+ * the same seed and the same inputs, a step at a time. Their states are
+ * compared after every step that spawned or advanced anything in either, and
+ * after every input, and their screens whenever the kernel would redraw.
+ * Stop at the first difference and dump both.
+ *
+ * The inputs are random, or those of a replay saved on a disk image by the
+ * kernel (-r). A replay must also end on the score it was saved with, unless
+ * it was truncated or played with settings changed from the console.
+ *
+ * Usage: leadsim-lockstep [seed [level [events]]]
+ *        leadsim-lockstep -r image slot */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "kernel.h"
+#include "refkernel.h"
+
+/* As in lead.c */
+#define SECTOR       (512)
+#define REPLAY_SHIFT (29)
+#define REPLAY_MAGIC (0x3252444Cu)
+
+enum {
+    REPLAY_STEPS,
+    REPLAY_LEFT,
+    REPLAY_RIGHT,
+    REPLAY_FIRE,
+    REPLAY_UPDATE,
+    REPLAY_PAUSE
+};
+
+/* Steps between random inputs, on average */
+#define EVENT_STEPS (5000)
+
+/* Random input, from a generator independent of the games' own: mostly
+ * update()s, as in the kernel, then moves and shots, and now and then a
+ * pause. */
+static uint32_t next_event(uint32_t *x, uint32_t *steps)
+{
+    uint32_t r;
+    *x = *x * 1103515245 + 12345;
+    r = (*x >> 16) % 64;
+    *steps = (*x >> 4) % (2 * EVENT_STEPS);
+    if (r < 32)
+        return REPLAY_UPDATE;
+    if (r < 42)
+        return REPLAY_LEFT;
+    if (r < 52)
+        return REPLAY_RIGHT;
+    if (r < 63)
+        return REPLAY_FIRE;
+    return REPLAY_PAUSE;
+}
+
+/* The header of the replay loaded: magic, seed, level, score, events, and
+ * whether it was truncated and whether it was played with changed settings */
+static uint32_t header[7];
+
+/* Read the replay in slot of image into header and events. Return 0 if there
+ * is none. */
+static int load_replay(const char *image, uint32_t slot, uint32_t **events)
+{
+    FILE *f = fopen(image, "rb");
+
+    if (!f) {
+        perror(image);
+        return 0;
+    }
+    if (fseek(f, (1 + (long) slot * REPLAY_SECTORS) * SECTOR, SEEK_SET)
+            || fread(header, sizeof(header), 1, f) != 1
+            || header[0] != REPLAY_MAGIC
+            || !(*events = malloc((header[4] + 1) * sizeof(**events)))
+            || fread(*events, sizeof(**events), header[4], f) != header[4]) {
+        fprintf(stderr, "%s: no replay in slot %u\n", image, slot);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+    printf("replay in slot %u: seed %08x level %u, score %u, %u events%s%s\n",
+           slot, header[1], header[2], header[3], header[4],
+           header[5] ? ", truncated" : "", header[6] ? ", tuned" : "");
+    return 1;
+}
+
+/* Compare the digests of both engines, of the screens too if redraw. If they
+ * differ, report where: after step of the steps before event e number i, or
+ * after e itself if applied. Then dump both and return 0. */
+static int check(uint32_t i, uint32_t e, uint32_t step, uint32_t steps,
+                 int applied, int redraw)
+{
+    uint64_t a_state, a_screen = 0, b_state, b_screen = 0;
+
+    kernel_digest(0, &a_state, redraw ? &a_screen : NULL);
+    ref_digest(&b_state, redraw ? &b_screen : NULL);
+    if (a_state == b_state && a_screen == b_screen)
+        return 1;
+    if (applied)
+        printf("diverged at event %u (event %u), after the event: ", i, e);
+    else
+        printf("diverged at event %u (event %u), after step %u of %u: ",
+               i, e, step, steps);
+    printf("%s differs\n", a_state != b_state ? "state" : "screen");
+    printf("\n== lead.c ==\n");
+    kernel_digest(0, &a_state, &a_screen);
+    kernel_dump(0, stdout);
+    printf("\n== reference ==\n");
+    ref_digest(&b_state, &b_screen);
+    ref_dump(stdout);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t seed = 1, level = 1, n = 100000, i, s, steps, e, x;
+    uint32_t *events = NULL;
+    struct leadsim_game g;
+    int a, b;
+
+    if (argc == 4 && !strcmp(argv[1], "-r")) {
+        if (!load_replay(argv[2], strtoul(argv[3], NULL, 0), &events))
+            return 2;
+        n = header[4];
+        seed = header[1];
+        level = header[2];
+    } else {
+        if (argc > 1)
+            seed = strtoul(argv[1], NULL, 0);
+        if (argc > 2)
+            level = strtoul(argv[2], NULL, 0);
+        if (argc > 3)
+            n = strtoul(argv[3], NULL, 0);
+    }
+    if (level < 1 || level > 4) {
+        fprintf(stderr, "usage: %s [seed [level [events]]]\n"
+                        "       %s -r image slot\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    /* Both engines draw to text-mode video memory. */
+    if (mmap((void *) 0xB8000, 0x8000, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        perror("mmap 0xB8000");
+        return 1;
+    }
+
+    kernel_reset(0, seed, level);
+    ref_reset(seed, level);
+    kernel_get(0, &g);
+    x = seed;
+    for (i = 0; i < n; i++) {
+        if (events) {
+            e = events[i] >> REPLAY_SHIFT;
+            steps = events[i] & ((1u << REPLAY_SHIFT) - 1);
+        } else e = next_event(&x, &steps);
+        for (s = 0; s < steps; s++) {
+            a = kernel_step(0);
+            b = ref_step();
+            if ((a || b) && !check(i, e, s + 1, steps, 0, a == 2 || b == 2))
+                return 1;
+        }
+        kernel_apply(0, e);
+        ref_apply(e);
+        if (!check(i, e, steps, steps, 1, 1))
+            return 1;
+        kernel_get(0, &g);
+        if (g.game_over && !events)
+            break;
+    }
+    printf("%u events in lockstep: score %u level %u%s\n", i < n ? i + 1 : n,
+           g.score, g.level, g.game_over ? ", game over" : "");
+    if (events && header[5])
+        printf("the replay was truncated, so it stops short of score %u\n",
+               header[3]);
+    else if (events && header[6])
+        printf("the replay was played with changed settings, so it need not "
+               "end on score %u\n", header[3]);
+    else if (events && g.score != header[3]) {
+        printf("but the replay was saved with score %u\n", header[3]);
+        free(events);
+        return 1;
+    }
+    free(events);
+    return 0;
+}
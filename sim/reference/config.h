@@ -0,0 +1,94 @@
+/* About data, shown on boot and when paused */
+#define LEAD_NAME    "Bare Metal Lead"
+#define LEAD_VERSION "1.0.0"
+#define LEAD_URL     "https://github.com/Aragox/bare-metal-lead"
+
+/* Lead well dimensions */
+#define WELL_WIDTH  (28)
+#define WELL_HEIGHT (22)
+
+/* Sizes of the enemy and player laser pools. The stress build fills them far
+ * beyond what the game ever spawns. */
+#ifdef STRESS
+#define N_ENEMYS (4096)
+#define N_LASERS (4096)
+#else
+#define N_ENEMYS (25)
+#define N_LASERS (25)
+#endif
+
+/* Main loop iterations between enemy spawns and movements, and between
+ * scrolls of the well, at level 1 */
+#define ENEMYSPAWN      (200000)
+#define ENEMYMOVE       (100000)
+#define WALLMOVE        (37500)
+
+/* Main loop iterations per tick, on which the enemys and the well advance by
+ * their velocities. ENEMYMOVE and WALLMOVE are turned into velocities, in
+ * cells per tick. */
+#define TICK            (12500)
+
+/* Corridor drift: the longest run of rows the corridor drifts one way (or
+ * keeps straight) before the generator picks a new direction */
+#define CORRIDOR_RUN (18)
+
+/* Enemy steering: the most rows up the well that enemys look for walls in
+ * before drifting toward the player */
+#define FLOW_DEPTH (8)
+
+/* Initial interval in milliseconds at which to apply gravity */
+#define INITIAL_SPEED (1000)
+
+/* Delay in milliseconds before rows are cleared */
+#define CLEAR_DELAY (100)
+
+/* Scoring: points for each enemy shot down (levels 1 and 3) or let past
+ * (levels 2 and 4), and the points that take the player up each level */
+#define SCORE_KILL  (3)
+#define SCORE_DODGE (3)
+#define SCORE_LEVEL (60)
+
+/* Rewind: total memory in bytes for captured frames, the number of frames
+ * between full key frames (deltas are stored in between) and the interval in
+ * milliseconds at which frames are captured and stepped back through. */
+#define REWIND_BUDGET   (256 * 1024)
+#define REWIND_KEYFRAME (16)
+#define REWIND_INTERVAL (50)
+
+/* Autoplay: number of wall or enemy movements the bot looks ahead for each
+ * candidate move, and the CPU ticks it may spend deciding on each one. */
+#define BOT_DEPTH  (8)
+#define BOT_BUDGET (200000)
+
+/* Particles: the size of the pool (a power of two), the interval in
+ * milliseconds at which they move, and the CPU ticks each of moving and
+ * drawing them may take per frame before the oldest are dropped. */
+#define N_PARTICLES       (256)
+#define PARTICLE_INTERVAL (40)
+#define PARTICLE_BUDGET   (100000)
+
+/* Storage: the number of high scores kept on disk, the sectors set aside for
+ * the replay of each, and the most sectors queued to be written at once */
+#define N_HIGHSCORES   (8)
+#define REPLAY_SECTORS (64)
+#define DISK_QUEUE     (128)
+
+/* Input latency: the number of recent inputs the statistics cover, and how
+ * many inputs apart they are sent to COM1 */
+#define LATENCY_SAMPLES (256)
+#define LATENCY_REPORT  (16)
+
+/* Watchdog: the microseconds one main loop iteration may take before it is
+ * logged as an overrun, the number of recent events kept for the report on a
+ * CPU exception (a power of two), and the milliseconds the report stays up before the reset
+ * (a key press resets at once). */
+#define FRAME_BUDGET (16667)
+#define TRACE_EVENTS (32)
+#define CRASH_WAIT   (30000)
+
+/* Stress build: the first number of enemys and lasers each (doubled at every
+ * step up to the pool sizes), the seed they are placed from, and the frames
+ * timed at each step. */
+#define STRESS_MIN    (16)
+#define STRESS_SEED   (0x1EAD)
+#define STRESS_FRAMES (32)
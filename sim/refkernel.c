@@ -0,0 +1,56 @@
+/* Built like kernel.c, from the frozen copy of lead.c. Its object file has
+ * every symbol but the ref_ functions made local, so that it links next to
+ * kernel.c's build of the current lead.c. */
+
+#define main   lead_main
+#define putc   lead_putc
+#define puts   lead_puts
+#define memcpy lead_memcpy
+#define memset lead_memset
+#define rand   lead_rand
+#define srand  lead_srand
+#define pow    lead_pow
+#include "reference/lead.c"
+#undef main
+#undef putc
+#undef puts
+#undef memcpy
+#undef memset
+#undef rand
+#undef srand
+#undef pow
+
+#include "refkernel.h"
+#include "digest.h"
+
+void ref_reset(uint32_t s, uint32_t l)
+{
+    score = 0;
+    game_over = false;
+    paused = false;
+    sprite_init();
+    lead_srand(s);
+    next_level(l);
+}
+
+int ref_step(void)
+{
+    return digest_step();
+}
+
+void ref_apply(uint8_t e)
+{
+    replay_apply(e);
+}
+
+void ref_digest(uint64_t *state, uint64_t *screen)
+{
+    *state = digest_state();
+    if (screen)
+        *screen = digest_screen();
+}
+
+void ref_dump(FILE *f)
+{
+    dump_state(f);
+}
@@ -0,0 +1,28 @@
+#ifndef REFKERNEL_H
+#define REFKERNEL_H
+
+/* The frozen reference engine: sim/reference/lead.c, a copy of lead.c as it
+ * was when gameplay last changed on purpose (make freeze-reference), built
+ * for the host. It plays a single game. */
+
+#include <stdint.h>
+#include <stdio.h>
+
+void ref_reset(uint32_t seed, uint32_t level);
+
+/* Run one iteration of step(), and return what it did, as kernel_step()
+ * does. */
+int ref_step(void);
+
+/* Apply replay event e. */
+void ref_apply(uint8_t e);
+
+/* Digest the state and, unless screen is NULL, the screen, as sim/digest.h
+ * does. The screen is redrawn at 0xB8000, which the caller must have
+ * mapped. */
+void ref_digest(uint64_t *state, uint64_t *screen);
+
+/* Write the state and the screen last drawn to f. */
+void ref_dump(FILE *f);
+
+#endif